@@ -9,38 +9,244 @@
 #include <FFOS/error.h>
 #include <ffbase/string.h>
 #include <ffbase/vector.h>
+#include <util/hdrhist.h>
+#include <util/rand.h>
+#include <util/alias.h>
+#include <util/zipf.h>
+#include <util/crc32c.h>
+#include <util/bufpool.h>
+#include <util/timerwheel.h>
+#include <util/http1.h>
 
 #define AGG_VER  "0.3"
 
+#define AGG_CACHELINE  64
+
+#define AGG_IOV_MAX  1024 // max. N of buffers for one writev() (UIO_MAXIOV)
+
+#define AGG_DISCARD_BUF  (64*1024) // size of the buffer for response body data that is read only to be discarded
+
 typedef unsigned int uint;
 
+enum AGG_ARRIVAL {
+	AGG_ARRIVAL_CONSTANT,
+	AGG_ARRIVAL_POISSON, // exponential inter-arrival times
+	AGG_ARRIVAL_ONOFF, // Poisson arrivals during ON periods, silence during OFF periods
+};
+
+enum AGG_IO {
+	AGG_IO_KQ, // epoll/kqueue/IOCP via ffkq
+	AGG_IO_URING, // Linux io_uring
+};
+
+enum AGG_OUTPUT {
+	AGG_OUT_TEXT,
+	AGG_OUT_JSON,
+};
+
+enum AGG_KEY_DIST {
+	AGG_KEY_UNIFORM,
+	AGG_KEY_ZIPF,
+};
+
+/** Expected response body of a request (--verify) */
+struct agg_check {
+	uint enabled;
+	uint with_crc; // 0:check only the length
+	ffuint64 len;
+	uint crc; // CRC32C
+};
+
+/** Request template segment */
+enum AGG_VAR {
+	AGG_V_TEXT, // data in conf.req_data
+	AGG_V_KEY, // {key}: key from the keyspace
+	AGG_V_SEQ, // {seq}: request number, unique across the workers
+	AGG_V_RAND, // {rand:MIN-MAX}
+	AGG_V_UUID, // {uuid}: random UUID v4
+	AGG_V_CONN_ID, // {conn_id}
+	AGG_V_WORKER_ID, // {worker_id}
+	AGG_V_USEC, // {usec}: microseconds since the start
+	AGG_V_CLEN, // Content-Length value of the body with variables
+	AGG_V_FILE, // conf.body_data
+};
+
+struct agg_seg {
+	uint type; // enum AGG_VAR
+	uint off, len; // AGG_V_TEXT
+	ffuint64 min, max; // AGG_V_RAND
+};
+
+/** Request compiled into literal and variable segments */
+struct agg_tpl {
+	uint seg_first, seg_n; // segments in conf.segs
+	uint body_seg; // index of the first body segment counted by AGG_V_CLEN
+	uint vars_size; // max. size of the variable values;  0:request has no variables
+};
+
+enum AGG_IVL_FMT {
+	AGG_IVL_CSV,
+	AGG_IVL_JSON, // JSON object per line
+};
+
+/** Target server */
+struct agg_backend {
+	ffsockaddr addr;
+	ffstr name; // "HOST:PORT"
+	uint weight; // share of connections
+	ffvec reqs; // uint[]: requests to this server (index in conf.reqs)
+	struct alias_table alias; // weighted selection of 'reqs';  n=0: round-robin
+};
+
 struct conn;
+struct uring;
 struct conf {
-	ffsockaddr addr;
+	ffvec backends; // struct agg_backend[]
+	uint backend_weights_total;
+	ffvec backend_weights; // ffstr[]: "HOST:PORT=N" from command line
+	ffvec sources; // ffsockaddr[]: local addresses for the connections;  empty:any
+	uint local_port_lo, local_port_n; // local ports, split between the workers;  n=0:selected by the kernel
 	uint threads;
 	uint connections_n;
 	uint keepalive_reqs;
+	uint pipeline; // N of requests in flight per connection
+	uint rate; // requests/sec; 0:closed loop
+	uint arrival; // enum AGG_ARRIVAL
+	uint burst_on_msec, burst_off_msec;
+	ffuint64 seed;
 	uint total_reqs;
 	uint fd_limit;
 	uint events_num;
 	uint rbuf_size;
+	uint connect_timeout_msec, ttfb_timeout_msec, resp_timeout_msec, idle_timeout_msec; // 0:disable
+	uint warmup_sec, duration_sec, cooldown_sec; // timed run;  duration 0:until stopped
+	uint interval_msec; // time-series report;  0:disable
+	uint interval_fmt; // enum AGG_IVL_FMT
+	char *interval_file; // NULL:stdout
 	uint debug;
+	uint output; // enum AGG_OUTPUT
+	uint io_engine; // enum AGG_IO
 	uint cpumask; // 0:disable
 	ffstr method;
 	ffvec paths; // ffstr[]
 	ffvec headers;
+	char *body_file;
+	ffstr body_data; // request body: --body-file data mapped to memory
+	char *scenario_file;
+	char *verify_file;
+	struct agg_check *checks; // [reqs.len];  NULL:verification is disabled
 	ffvec reqs; // ffstr[];  The prepared request data ready to send
+	ffvec req_data; // data of all requests in one buffer: 'reqs' point here
+	ffvec weights; // uint[]: weight of each request
+	ffvec tpls; // struct agg_tpl[reqs.len]
+	ffvec segs; // struct agg_seg[]
+	uint req_segs_max, req_vars_max; // max. N of segments and size of variables of one request
+	ffuint64 keys_n; // keyspace size;  0:disable
+	uint key_dist; // enum AGG_KEY_DIST
+	double key_zipf_s;
+	struct zipf key_zipf;
 
-	ffvec workers;
+	ffslice workers; // struct worker[];  aligned to cache line
 	ffuint64 start_time_usec;
-	uint nreqs;
+	uint quota_batch; // N of requests a worker takes from 'reqs_left' at once
+	ffint64 reqs_left; // global pool of requests;  may go below 0 when it's exhausted
 };
 extern struct conf *agg_conf;
 
+enum AGG_TIMEOUT {
+	AGG_TO_CONNECT,
+	AGG_TO_TTFB, // time to first byte of response
+	AGG_TO_RESP, // complete response
+	AGG_TO_IDLE, // keep-alive connection waiting for the next scheduled request
+	AGG_TO_N,
+};
+
+/** Intervals between the time points of a request */
+enum AGG_LAT {
+	AGG_LAT_SEND, // start .. request is fully written
+	AGG_LAT_TTFB, // .. first byte of response
+	AGG_LAT_HEADER, // .. header is complete
+	AGG_LAT_BODY, // .. body is complete
+	AGG_LAT_TOTAL, // start .. body is complete
+	AGG_LAT_N,
+};
+
+enum AGG_PHASE {
+	AGG_PHASE_WARMUP,
+	AGG_PHASE_MEASURE, // the only phase for an untimed run
+	AGG_PHASE_COOLDOWN,
+	AGG_PHASE_N,
+};
+
+#define AGG_STATUS_N  1000 // HTTP status code has 3 digits
+#define AGG_CLASS_N  6 // status code class: 1xx..5xx;  0:other
+
+/** Get status code class */
+static inline uint agg_status_class(uint code)
+{
+	uint c = code / 100;
+	return (c < AGG_CLASS_N) ? c : 0;
+}
+
+/** Statistics of one request (index in conf.reqs) */
+struct agg_url_stat {
+	ffuint64 resp_ok, resp_err;
+	ffuint64 classes[AGG_CLASS_N]; // N of responses by status code class
+};
+
+/** Max. N of requests that have their own latency histogram.
+A histogram takes ~20KB per worker per phase:
+ a scenario replaying an access log has only the counters for each request. */
+#define AGG_URL_HIST_MAX  64
+
+/** Statistics of one target server */
+struct agg_backend_stat {
+	ffuint64 connections_ok, connections_failed, resp_ok, resp_err;
+	struct hdrhist resp_latency;
+};
+
 struct agg_stat {
 	ffuint64 total_sent, total_recv;
 	ffuint64 connections_ok, connections_failed, resp_ok, resp_err;
-	ffuint64 connect_latency_usec, resp_latency_usec;
+	ffuint64 timeouts[AGG_TO_N];
+	ffuint64 verify_err; // N of responses with unexpected body
+	struct hdrhist connect_latency, resp_latency; // usec
+	ffuint64 status[AGG_STATUS_N]; // N of responses by status code
+	struct hdrhist class_latency[AGG_CLASS_N]; // response latency by status code class
+	struct hdrhist req_latency[AGG_LAT_N]; // enum AGG_LAT
+	struct agg_url_stat *urls; // [reqs.len]
+	struct hdrhist *url_latency; // [reqs.len];  NULL if there are more than AGG_URL_HIST_MAX requests
+	struct agg_backend_stat *backends; // [backends.len]
+};
+
+/** Allocate the per-URL and per-server statistics */
+static inline void stat_alloc(struct agg_stat *s)
+{
+	s->urls = ffmem_calloc(agg_conf->reqs.len, sizeof(struct agg_url_stat));
+	if (agg_conf->reqs.len <= AGG_URL_HIST_MAX)
+		s->url_latency = ffmem_calloc(agg_conf->reqs.len, sizeof(struct hdrhist));
+	s->backends = ffmem_calloc(agg_conf->backends.len, sizeof(struct agg_backend_stat));
+}
+
+static inline void stat_free(struct agg_stat *s)
+{
+	ffmem_free(s->urls);
+	ffmem_free(s->url_latency);
+	ffmem_free(s->backends);
+}
+
+/** Counters of a worker for the time-series report */
+struct agg_counters {
+	ffuint64 resp_ok, resp_err, timeouts; // timeouts: except AGG_TO_IDLE
+	ffuint64 total_sent, total_recv;
+	ffuint64 conns_open;
+};
+
+/** Worker's data for one interval of the time-series report */
+struct agg_interval {
+	uint index; // interval number;  -1:not published
+	struct agg_counters total; // counters since the start, at the end of the interval
+	struct hdrhist resp_latency; // responses received during the interval
 };
 
 struct worker {
@@ -50,32 +256,103 @@ struct worker {
 	ffkq_event *kevents;
 	int icpu; // -1:disable affinity
 	uint worker_stop;
-	uint next_req;
+	uint *next_req; // [backends.len] round-robin selection of requests
+	int *backend_cur; // [backends.len] smooth weighted round-robin selection of servers
+	uint src_next; // round-robin selection of local address
+	uint port_first, port_n, port_next; // this worker's slice of the local ports
+	struct xrand rnd; // arrival times, weighted selection of requests
+	uint quota; // N of requests this worker may complete before taking from the global pool
 	ffkq_postevent post;
 	struct conn *cpost;
+	struct uring *uring; // io_uring engine state
+	struct bufpool rbufs; // buffers for response headers
+	char *rbuf_discard; // [AGG_DISCARD_BUF] response body data is received here and discarded
+	struct conn_req *creqs; // conn_req[connections * pipeline]
+	ffstr *wq; // ffstr[connections * pipeline * req_segs_max]
+	ffiovec *iov; // ffiovec[connections * pipeline * req_segs_max]
+	char *vars; // [connections * pipeline * req_vars_max]
+	uint index; // position in conf.workers
+	ffuint64 seq; // N of expanded {seq} values
+
+	// open-loop scheduler:
+	ffuint64 sched_next_nsec; // intended send time of the next request
+	ffuint64 sched_interval_nsec; // mean interval
+	ffuint64 sched_burst_nsec; // start of the current ON period
+	struct conn *idle; // connections waiting for the next scheduled request
+
+	struct twheel timers;
 
-	struct agg_stat stats;
+	struct agg_stat stats[AGG_PHASE_N];
+	struct agg_stat *st; // statistics of the current phase
+	uint conns_open;
+
+	// time-series report:
+	struct agg_interval *ivl; // [2]: the data of interval #k is collected in ivl[k % 2];  NULL:disabled
+	uint ivl_n; // N of published intervals
+} __attribute__((aligned(AGG_CACHELINE))); // neighbour workers never share a cache line
+
+/** Request sent (or queued) on a connection and waiting for its response */
+struct conn_req {
+	uint ireq; // index in conf.reqs
+	ffuint64 start_usec;
+	ffuint64 sent_usec, first_usec, hdr_usec; // time points;  0:not yet
+	ffuint64 deadline; // response timer tick;  0:disabled
+	char *vars; // [req_vars_max] values of the template variables
 };
 
 typedef void (*kev_handler)(struct conn *c);
 struct conn {
+	uint index; // position in worker's array
+	uint ibackend; // target server (index in conf.backends);  selected for each new connection
+	uint side; // toggled on each new connection so that stale events are skipped
+	struct conn_req *reqs; // [pipeline] FIFO of requests in flight
+	ffstr *wq; // [pipeline * req_segs_max] request data not yet sent
+	ffiovec *iov; // [pipeline * req_segs_max]
+	// next data is cleared on each new connection
+
 	kev_handler rhandler, whandler;
-	uint side;
 	ffkq_task kqtask, kqtask2;
 
 	ffsock sk;
 	struct worker *w;
-	uint keepalive;
+	uint keepalive; // N of finished responses
+	uint nsent; // N of queued requests
 	unsigned kq_attach_ok :1;
-	// next data is cleared on each new request
+	unsigned connected :1;
+	unsigned idle :1; // in worker's idle list
+	unsigned recv_active :1; // receiving responses
+	struct conn *idle_next, *idle_prev;
+	struct twheel_timer tmr;
+	uint tmr_kind; // enum AGG_TIMEOUT
+	ffuint64 start_time_usec; // connection start
+	ffuint64 sched_usec; // intended send time of the next request (open-loop mode)
+
+	uint req_first, req_n; // requests in flight: the oldest one in 'reqs' and their number
+	uint wq_off, wq_n; // unsent data in 'wq'
+	uint wq_reqs; // N of requests in 'wq'
+
+	char *buf; // response header data; from worker's pool, held only while the header is being received
+	uint bufn; // N of bytes in 'buf';  may contain the next pipelined responses
+	ffuint64 recv_usec; // time of the last received data
+
+	// io_uring engine:
+	uint ur_ops; // enum URING_F
+	int ur_connect_res, ur_send_res;
+	uint ur_rq_first, ur_rq_last; // queue of received buffers: buffer ID + 1;  0:empty
+	uint ur_rq_off; // offset of unread data in the first buffer
+	int ur_recv_err; // -1:EOF;  >0:system error
+	// next data is cleared on each new response
 
-	ffstr wdata;
-	ffuint64 start_time_usec;
 	ffuint64 cont_len;
+	uint hdr_off; // offset in 'buf' of the next header line to parse
+	struct httpchunked chunked;
+	uint resp_code;
 	unsigned resp_line_ok :1;
 	unsigned resp_err :1;
-	uint bufn;
-	char buf[0];
+	unsigned resp_chunked :1; // "Transfer-Encoding: chunked"
+	unsigned verify :1; // the body is checked against conf.checks
+	uint body_crc;
+	ffuint64 body_len;
 };
 
 #define agg_dbg(fmt, ...) \
@@ -89,13 +366,55 @@ do { \
 	ffstderr_fmt("error: " fmt ": %s\n", ##__VA_ARGS__, fferr_strptr(fferr_last()))
 
 
-/**
+/** Account a finished request or connection against the worker's quota
 closed: whether connection is closed
-Return 1: all done */
+Return 1: all done: the worker is stopping */
 int agg_conn_fin(struct conn *c, int closed);
 
 ffuint64 time_usec();
 
 
+/** Print the results in JSON
+phases: merged statistics of all workers
+t_ms: duration of the measurement phase */
+void stats_json(const struct agg_stat *phases, ffuint64 t_ms, ffuint64 rbufs_peak);
+
+/** Start the time-series reporter thread */
+int interval_start();
+void interval_stop();
+
+/** Publish the worker's data for the finished interval
+Return N of msec until the end of the current interval */
+int interval_update(struct worker *w, ffuint64 now_usec);
+
+
 void conn_start(struct conn *c, struct worker *w);
+/** Send the scheduled requests to idle connections
+Return N of msec until the next request is due;
+ -1 if there are no idle connections */
+int conn_sched(struct worker *w);
 void conn_close(struct conn *c);
+
+#ifdef FF_LINUX
+/** Create io_uring instance for a worker
+nconn: max. number of connections */
+int uring_create(struct worker *w, uint nconn);
+void uring_free(struct worker *w);
+
+/** Submit the prepared operations, wait for completions and call connection handlers
+timeout_msec: -1:infinite
+Return 0 on success */
+int uring_process(struct worker *w, int timeout_msec);
+
+/** These functions have the same semantics as ffsock_*_async():
+ the first call starts the operation and returns -1 with FFSOCK_EINPROGRESS error;
+ the connection handler is called on completion and must call the function again to get the result */
+int uring_connect(struct conn *c, const ffsockaddr *addr);
+int uring_sendv(struct conn *c, ffiovec *iov, uint n);
+/** Get received data
+buf: NULL: skip the data */
+int uring_recv(struct conn *c, void *buf, ffsize cap);
+
+/** Cancel pending operations and release received buffers */
+void uring_close(struct conn *c);
+#endif
@@ -2,18 +2,23 @@
 2022, Simon Zolin */
 
 #include <aggressor.h>
-#include <util/http1.h>
 #include <ffbase/atomic.h>
 
 static void conn_connect(struct conn *c);
+static void conn_req_next(struct conn *c);
 static void conn_req_send(struct conn *c);
 static void conn_resp_recv(struct conn *c);
 static int conn_resp_parse(struct conn *c);
 static void conn_respdata_recv(struct conn *c);
+static int conn_chunked(struct conn *c, ffstr *data);
+static int conn_resp_done(struct conn *c);
 static void conn_end(struct conn *c);
 
 static void conn_attach(struct conn *c)
 {
+	if (agg_conf->io_engine != AGG_IO_KQ)
+		return;
+
 	if (!c->kq_attach_ok) {
 		c->kq_attach_ok = 1;
 		if (0 != ffkq_attach_socket(c->w->kq, c->sk, (void*)((ffsize)c | c->side), FFKQ_READWRITE))
@@ -22,26 +27,221 @@ static void conn_attach(struct conn *c)
 	}
 }
 
-static void conn_prep(struct conn *c)
+static void conn_buf_release(struct conn *c)
+{
+	if (c->buf != NULL) {
+		bufpool_put(&c->w->rbufs, c->buf);
+		c->buf = NULL;
+	}
+}
+
+static void conn_resp_prep(struct conn *c)
+{
+	ffmem_zero(&c->cont_len, sizeof(struct conn) - FF_OFF(struct conn, cont_len));
+}
+
+/** Start connecting or get the result */
+static int conn_io_connect(struct conn *c)
+{
+	const ffsockaddr *addr = &ffslice_itemT(&agg_conf->backends, c->ibackend, struct agg_backend)->addr;
+#ifdef FF_LINUX
+	if (agg_conf->io_engine == AGG_IO_URING)
+		return uring_connect(c, addr);
+#endif
+	return ffsock_connect_async(c->sk, addr, &c->kqtask);
+}
+
+static int conn_io_sendv(struct conn *c, ffiovec *iov, uint n)
 {
-	ffmem_zero(&c->wdata, sizeof(struct conn) - FF_OFF(struct conn, wdata));
+#ifdef FF_LINUX
+	if (agg_conf->io_engine == AGG_IO_URING)
+		return uring_sendv(c, iov, n);
+#endif
+	return ffsock_sendv_async(c->sk, iov, n, &c->kqtask2);
+}
+
+static int conn_io_recv(struct conn *c, void *buf, ffsize cap)
+{
+#ifdef FF_LINUX
+	if (agg_conf->io_engine == AGG_IO_URING)
+		return uring_recv(c, buf, cap);
+#endif
+	return ffsock_recv_async(c->sk, buf, cap, &c->kqtask);
+}
+
+/** Receive the data and discard it
+Linux: TCP socket drops the data with MSG_TRUNC, without copying it to user space;
+ io_uring: the received buffers are recycled without copying */
+static int conn_io_discard(struct conn *c, ffsize cap)
+{
+#ifdef FF_LINUX
+	if (agg_conf->io_engine == AGG_IO_URING)
+		return uring_recv(c, NULL, cap);
+
+	int r = ffsock_recv(c->sk, NULL, cap, MSG_TRUNC | MSG_DONTWAIT);
+	if (r >= 0 || !fferr_again(fferr_last()))
+		return r;
+	// No data yet: wait for the signal;  the data received meanwhile is read in the usual way
+#endif
+	return ffsock_recv_async(c->sk, c->w->rbuf_discard, ffmin(cap, AGG_DISCARD_BUF), &c->kqtask);
+}
+
+static void conn_timeout(struct twheel_timer *t)
+{
+	static const char names[][12] = {
+		"connect", "first byte", "response", "idle",
+	};
+	struct conn *c = FF_STRUCTPTR(struct conn, tmr, t);
+	c->w->st->timeouts[c->tmr_kind]++;
+	if (c->tmr_kind != AGG_TO_IDLE)
+		agg_dbg("%p: %s timeout", c, names[c->tmr_kind]);
+	conn_end(c);
+}
+
+/** Arm the connection's timer
+expire: timer tick;  0:disarm */
+static void conn_timer(struct conn *c, uint kind, ffuint64 expire)
+{
+	if (expire == 0) {
+		twheel_del(&c->w->timers, &c->tmr);
+		return;
+	}
+	c->tmr_kind = kind;
+	twheel_add(&c->w->timers, &c->tmr, expire, conn_timeout);
+}
+
+/** Get timer tick after 'msec';  0 if the timeout is disabled */
+static ffuint64 conn_deadline(struct conn *c, uint msec)
+{
+	if (msec == 0)
+		return 0;
+	return c->w->timers.now + msec;
+}
+
+static void conn_idle_add(struct conn *c)
+{
+	struct worker *w = c->w;
+	c->idle = 1;
+	c->idle_prev = NULL;
+	c->idle_next = w->idle;
+	if (w->idle != NULL)
+		w->idle->idle_prev = c;
+	w->idle = c;
+}
+
+static void conn_idle_remove(struct conn *c)
+{
+	if (!c->idle)
+		return;
+	c->idle = 0;
+	if (c->idle_prev != NULL)
+		c->idle_prev->idle_next = c->idle_next;
+	else
+		c->w->idle = c->idle_next;
+	if (c->idle_next != NULL)
+		c->idle_next->idle_prev = c->idle_prev;
+}
+
+/** Select the server for a new connection: smooth weighted round-robin
+Each server's counter grows by its weight;  the server with the highest counter is selected and its counter drops by the total weight.
+The servers are interleaved evenly, e.g. weights 5,1,1: a a b a c a a */
+static uint backend_select(struct worker *w)
+{
+	uint n = agg_conf->backends.len;
+	if (n == 1)
+		return 0;
+
+	const struct agg_backend *b = (struct agg_backend*)agg_conf->backends.ptr;
+	uint best = 0;
+	for (uint i = 0;  i != n;  i++) {
+		w->backend_cur[i] += b[i].weight;
+		if (w->backend_cur[i] > w->backend_cur[best])
+			best = i;
+	}
+	w->backend_cur[best] -= agg_conf->backend_weights_total;
+	return best;
+}
+
+/** Bind the socket to the next local address and port
+A worker takes the ports from its own slice, so the workers never bind to the same port.
+Without the port range the kernel selects the port at connect time (IP_BIND_ADDRESS_NO_PORT):
+ the port is then unique only for the 4-tuple, not for the local address. */
+static int conn_bind(struct conn *c, uint family)
+{
+	struct worker *w = c->w;
+	uint port = 0;
+	if (w->port_n != 0)
+		port = w->port_first + w->port_next;
+
+	// Each local address uses the port before the next port is taken
+	const ffsockaddr *src = NULL;
+	uint n = agg_conf->sources.len;
+	for (uint i = 0;  i != n;  i++) {
+		const ffsockaddr *a = ffslice_itemT(&agg_conf->sources, w->src_next, ffsockaddr);
+		if (++w->src_next == n) {
+			w->src_next = 0;
+			if (w->port_n != 0)
+				w->port_next = (w->port_next + 1 == w->port_n) ? 0 : w->port_next + 1;
+		}
+		if (a->ip4.sin_family == family) {
+			src = a;
+			break;
+		}
+	}
+	if (n == 0 && w->port_n != 0)
+		w->port_next = (w->port_next + 1 == w->port_n) ? 0 : w->port_next + 1;
+
+	ffsockaddr a = {};
+	char any[16] = {};
+	if (family == AF_INET)
+		ffsockaddr_set_ipv4(&a, (src != NULL) ? (void*)&src->ip4.sin_addr : any, port);
+	else
+		ffsockaddr_set_ipv6(&a, (src != NULL) ? (void*)&src->ip6.sin6_addr : any, port);
+
+	if (port != 0) {
+		// Allow binding to a port of our previous connection in TIME_WAIT state;
+		//  connect() to the same server then succeeds only with net.ipv4.tcp_tw_reuse=1
+		if (0 != ffsock_setopt(c->sk, SOL_SOCKET, SO_REUSEADDR, 1))
+			agg_syserr("set SO_REUSEADDR");
+	} else {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		if (0 != ffsock_setopt(c->sk, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, 1))
+			agg_syserr("set IP_BIND_ADDRESS_NO_PORT");
+#endif
+	}
+
+	if (0 != ffsock_bind(c->sk, &a)) {
+		agg_syserr("sock bind");
+		return -1;
+	}
+	return 0;
 }
 
 void conn_start(struct conn *c, struct worker *w)
 {
-	ffmem_zero(c, FF_OFF(struct conn, wdata));
-	conn_prep(c);
+	ffmem_zero(&c->rhandler, sizeof(struct conn) - FF_OFF(struct conn, rhandler));
 	c->w = w;
+	c->ibackend = backend_select(w);
+	const struct agg_backend *b = ffslice_itemT(&agg_conf->backends, c->ibackend, struct agg_backend);
 
-	c->sk = ffsock_create_tcp(agg_conf->addr.ip4.sin_family, FFSOCK_NONBLOCK);
+	c->sk = ffsock_create_tcp(b->addr.ip4.sin_family, FFSOCK_NONBLOCK);
 	if (c->sk == FFSOCK_NULL) {
 		agg_syserr("sock create");
-		c->w->stats.connections_failed++;
+		c->w->st->connections_failed++;
+		c->w->st->backends[c->ibackend].connections_failed++;
 		conn_end(c);
 		return;
 	}
 	agg_dbg("%p: new connection", c);
 
+	if ((agg_conf->sources.len != 0 || agg_conf->local_port_n != 0)
+		&& 0 != conn_bind(c, b->addr.ip4.sin_family)) {
+		c->w->st->connections_failed++;
+		c->w->st->backends[c->ibackend].connections_failed++;
+		conn_end(c);
+		return;
+	}
+
 #ifdef FF_WIN
 	conn_attach(c);
 #endif
@@ -53,13 +253,15 @@ static void conn_connect(struct conn *c)
 {
 	if (c->whandler == NULL) {
 		c->start_time_usec = time_usec();
+		conn_timer(c, AGG_TO_CONNECT, conn_deadline(c, agg_conf->connect_timeout_msec));
 	} else {
 		c->whandler = NULL;
 	}
-	if (0 != ffsock_connect_async(c->sk, &agg_conf->addr, &c->kqtask)) {
+	if (0 != conn_io_connect(c)) {
 		if (fferr_last() != FFSOCK_EINPROGRESS) {
 			agg_syserr("sock connect");
-			c->w->stats.connections_failed++;
+			c->w->st->connections_failed++;
+			c->w->st->backends[c->ibackend].connections_failed++;
 			conn_end(c);
 			return;
 		}
@@ -69,28 +271,260 @@ static void conn_connect(struct conn *c)
 		return;
 	}
 
-	c->w->stats.connections_ok++;
+	c->w->st->connections_ok++;
+	c->w->st->backends[c->ibackend].connections_ok++;
+	c->w->conns_open++;
+	c->connected = 1;
+	conn_timer(c, 0, 0);
 
 	agg_dbg("%p: connected", c);
 
+	if (0 != ffsock_setopt(c->sk, IPPROTO_TCP, TCP_NODELAY, 1))
+		agg_syserr("set TCP_NODELAY");
+
 	ffuint64 t = time_usec();
-	c->w->stats.connect_latency_usec = (c->w->stats.connect_latency_usec + t - c->start_time_usec) / 2;
+	hdrhist_add(&c->w->st->connect_latency, t - c->start_time_usec);
+	conn_req_next(c);
+}
+
+/** Get the time of the next arrival after 'prev' */
+static ffuint64 sched_arrival(struct worker *w, ffuint64 prev)
+{
+	switch (agg_conf->arrival) {
+	case AGG_ARRIVAL_POISSON:
+		return prev + (ffuint64)xrand_exp(&w->rnd, w->sched_interval_nsec);
+
+	case AGG_ARRIVAL_ONOFF: {
+		// The rate during ON periods is raised so that the mean rate stays the same.
+		// Exponential inter-arrival times are memoryless,
+		//  so an arrival crossing the end of the ON period is just shifted by the OFF period length.
+		ffuint64 on = agg_conf->burst_on_msec * 1000000ULL, off = agg_conf->burst_off_msec * 1000000ULL;
+		ffuint64 t = prev + (ffuint64)xrand_exp(&w->rnd, (double)w->sched_interval_nsec * on / (on + off));
+		while (t >= w->sched_burst_nsec + on) {
+			t += off;
+			w->sched_burst_nsec += on + off;
+		}
+		return t;
+	}
+	}
+
+	return prev + w->sched_interval_nsec;
+}
+
+/** Get the intended send time of the next request and advance the schedule */
+static ffuint64 sched_take(struct worker *w)
+{
+	ffuint64 t = w->sched_next_nsec / 1000;
+	w->sched_next_nsec = sched_arrival(w, w->sched_next_nsec);
+	return t;
+}
+
+/** Send the next request now or wait until it's due */
+static void conn_req_next(struct conn *c)
+{
+	if (agg_conf->rate != 0) {
+		struct worker *w = c->w;
+		if (w->sched_next_nsec / 1000 > time_usec()) {
+			agg_dbg("%p: waiting for the next request", c);
+			c->rhandler = NULL;
+			c->whandler = NULL;
+			conn_idle_add(c);
+			conn_timer(c, AGG_TO_IDLE, conn_deadline(c, agg_conf->idle_timeout_msec));
+			return;
+		}
+		c->sched_usec = sched_take(w);
+	}
+
 	conn_req_send(c);
 }
 
+int conn_sched(struct worker *w)
+{
+	ffuint64 now = time_usec();
+	while (w->idle != NULL) {
+		ffuint64 t = w->sched_next_nsec / 1000;
+		if (t > now)
+			return (t - now + 999) / 1000;
+
+		struct conn *c = w->idle;
+		conn_idle_remove(c);
+		c->sched_usec = sched_take(w);
+		conn_req_send(c);
+	}
+	return -1;
+}
+
+/** Select the next request to the connection's server: weighted random or round-robin
+Return index in conf.reqs */
+static uint req_select(struct conn *c)
+{
+	struct worker *w = c->w;
+	const struct agg_backend *b = ffslice_itemT(&agg_conf->backends, c->ibackend, struct agg_backend);
+	const uint *reqs = (uint*)b->reqs.ptr;
+	if (b->alias.n != 0)
+		return reqs[alias_sample(&b->alias, xrand_next(&w->rnd))];
+
+	uint i = w->next_req[c->ibackend];
+	w->next_req[c->ibackend] = (i + 1 == b->reqs.len) ? 0 : i + 1;
+	return reqs[i];
+}
+
+/** Get the next key of the keyspace */
+static ffuint64 key_select(struct worker *w)
+{
+	if (agg_conf->key_dist == AGG_KEY_ZIPF)
+		return zipf_next(&agg_conf->key_zipf, &w->rnd);
+	return xrand_double(&w->rnd) * agg_conf->keys_n;
+}
+
+/** Write random UUID v4 */
+static uint uuid_write(char *buf, struct xrand *r)
+{
+	static const char hex[] = "0123456789abcdef";
+	ffuint64 a = xrand_next(r), b = xrand_next(r);
+	a = (a & ~0xf000ULL) | 0x4000ULL; // version 4
+	b = (b & ~(3ULL << 62)) | (2ULL << 62); // variant 1
+	char *p = buf;
+	for (int i = 60;  i >= 0;  i -= 4) {
+		if (i == 28 || i == 12)
+			*p++ = '-';
+		*p++ = hex[(a >> i) & 0x0f];
+	}
+	for (int i = 60;  i >= 0;  i -= 4) {
+		if (i == 44)
+			*p++ = '-';
+		*p++ = hex[(b >> i) & 0x0f];
+	}
+	return p - buf;
+}
+
+/** Queue the request data: expand the template variables into the request's own slot */
+static void req_expand(struct conn *c, struct conn_req *r)
+{
+	struct worker *w = c->w;
+	const struct agg_tpl *t = ffslice_itemT(&agg_conf->tpls, r->ireq, struct agg_tpl);
+	if (t->seg_n == 1) {
+		c->wq[c->wq_n++] = *ffslice_itemT(&agg_conf->reqs, r->ireq, ffstr);
+		return;
+	}
+
+	const struct agg_seg *sg = ffslice_itemT(&agg_conf->segs, t->seg_first, struct agg_seg);
+	char *p = r->vars;
+	ffstr *clen = NULL;
+	ffuint64 body = 0;
+	for (uint i = 0;  i != t->seg_n;  i++, sg++) {
+		ffstr *out = &c->wq[c->wq_n++];
+		ffuint64 v = 0;
+		uint n = 0;
+
+		switch (sg->type) {
+		case AGG_V_TEXT:
+			ffstr_set(out, (char*)agg_conf->req_data.ptr + sg->off, sg->len);
+			goto next;
+
+		case AGG_V_FILE:
+			*out = agg_conf->body_data; // all requests share the same pages
+			goto next;
+
+		case AGG_V_CLEN:
+			clen = out; // the body is not expanded yet
+			ffstr_set(out, p, 0);
+			p += 20;
+			goto next;
+
+		case AGG_V_UUID:
+			n = uuid_write(p, &w->rnd);
+			ffstr_set(out, p, n);
+			p += n;
+			goto next;
+
+		case AGG_V_KEY:
+			v = key_select(w);  break;
+		case AGG_V_SEQ:
+			v = w->seq++ * agg_conf->workers.len + w->index;  break;
+		case AGG_V_RAND:
+			if (sg->max - sg->min == (ffuint64)-1)
+				v = xrand_next(&w->rnd); // full range: the number of values doesn't fit into 64 bits
+			else
+				v = sg->min + (ffuint64)(xrand_double(&w->rnd) * (sg->max - sg->min + 1));
+			break;
+		case AGG_V_CONN_ID:
+			v = c->index * agg_conf->workers.len + w->index;  break;
+		case AGG_V_WORKER_ID:
+			v = w->index;  break;
+		case AGG_V_USEC:
+			v = time_usec() - agg_conf->start_time_usec;  break;
+		}
+
+		n = ffs_fromint(v, p, 20, 0);
+		ffstr_set(out, p, n);
+		p += n;
+
+	next:
+		if (i >= t->body_seg)
+			body += out->len;
+	}
+
+	if (clen != NULL)
+		clen->len = ffs_fromint(body, clen->ptr, 20, 0);
+}
+
+/** Queue the next requests so that 'pipeline' requests are in flight
+Return N of queued requests */
+static uint conn_req_add(struct conn *c)
+{
+	uint depth = agg_conf->pipeline, n = 0;
+	ffuint64 t = 0;
+
+	while (c->req_n != depth && c->nsent != agg_conf->keepalive_reqs) {
+		if (n == 0) {
+			// In open-loop mode the latency includes the time the request was waiting for a free connection
+			t = (agg_conf->rate != 0) ? c->sched_usec : time_usec();
+		}
+
+		struct conn_req *r = &c->reqs[(c->req_first + c->req_n) % depth];
+		r->ireq = req_select(c);
+		r->start_usec = t;
+		r->sent_usec = r->first_usec = r->hdr_usec = 0;
+		r->deadline = conn_deadline(c, agg_conf->resp_timeout_msec);
+		if (c->req_n == 0)
+			conn_timer(c, AGG_TO_RESP, r->deadline);
+		c->req_n++;
+		c->nsent++;
+
+		req_expand(c, r);
+		n++;
+	}
+	return n;
+}
+
+/** Start receiving the responses if not yet */
+static void conn_recv_start(struct conn *c)
+{
+	if (c->recv_active)
+		return;
+	c->recv_active = 1;
+	conn_resp_recv(c);
+}
+
+/** Send the queued requests with one system call;
+ queue the new requests if all data is sent */
 static void conn_req_send(struct conn *c)
 {
-	if (c->wdata.len == 0) {
-		c->wdata = *ffslice_itemT(&agg_conf->reqs, c->w->next_req, ffstr);
-		c->w->next_req++;
-		if (c->w->next_req == agg_conf->reqs.len)
-			c->w->next_req = 0;
-		if (0 != ffsock_setopt(c->sk, IPPROTO_TCP, TCP_NODELAY, 1))
-			agg_syserr("set TCP_NODELAY");
+	if (c->wq_off == c->wq_n) {
+		c->wq_off = c->wq_n = 0;
+		if (0 == (c->wq_reqs = conn_req_add(c)))
+			return;
 	}
 
-	while (c->wdata.len != 0) {
-		int r = ffsock_send_async(c->sk, c->wdata.ptr, c->wdata.len, &c->kqtask2);
+	while (c->wq_off != c->wq_n) {
+		uint n = ffmin(c->wq_n - c->wq_off, AGG_IOV_MAX);
+		for (uint i = 0;  i != n;  i++) {
+			const ffstr *d = &c->wq[c->wq_off + i];
+			ffiovec_set(&c->iov[i], d->ptr, d->len);
+		}
+
+		int r = conn_io_sendv(c, c->iov, n);
 		if (r < 0) {
 			if (fferr_last() != FFSOCK_EINPROGRESS) {
 				agg_syserr("sock send");
@@ -100,31 +534,78 @@ static void conn_req_send(struct conn *c)
 			agg_dbg("%p: sending request", c);
 			conn_attach(c);
 			c->whandler = conn_req_send;
+			// Read the responses while sending, otherwise the server may block on its output
+			conn_recv_start(c);
 			return;
 		}
 
-		ffstr_shift(&c->wdata, r);
-		c->w->stats.total_sent += r;
+		c->w->st->total_sent += r;
+		for (;;) {
+			ffstr *d = &c->wq[c->wq_off];
+			if ((ffsize)r < d->len) {
+				ffstr_shift(d, r);
+				break;
+			}
+			r -= d->len;
+			c->wq_off++;
+			if (c->wq_off == c->wq_n)
+				break;
+		}
 	}
 
 	agg_dbg("%p: sent request", c);
+	c->whandler = NULL;
 
-	c->start_time_usec = time_usec();
-	conn_resp_recv(c);
+	// The queued requests are the newest ones in flight
+	ffuint64 t = time_usec();
+	uint depth = agg_conf->pipeline;
+	for (uint i = 0;  i != c->wq_reqs && i != c->req_n;  i++) {
+		c->reqs[(c->req_first + c->req_n - 1 - i) % depth].sent_usec = t;
+	}
+
+	// Wait for the first byte of the next response
+	if (!c->resp_line_ok && c->bufn == 0
+		&& (c->tmr.next == NULL || c->tmr_kind == AGG_TO_RESP)) {
+		ffuint64 ttfb = conn_deadline(c, agg_conf->ttfb_timeout_msec);
+		ffuint64 dl = c->reqs[c->req_first].deadline;
+		if (ttfb != 0 && (dl == 0 || ttfb < dl))
+			conn_timer(c, AGG_TO_TTFB, ttfb);
+	}
+
+	conn_recv_start(c);
+}
+
+/** Fill the free pipeline slots while waiting for the responses */
+static void conn_req_refill(struct conn *c)
+{
+	if (c->req_n != agg_conf->pipeline
+		&& c->wq_off == c->wq_n)
+		conn_req_send(c);
 }
 
 static void conn_resp_recv(struct conn *c)
 {
 	for (;;) {
-		int r = ffsock_recv_async(c->sk, c->buf + c->bufn, agg_conf->rbuf_size - c->bufn, &c->kqtask);
+		if (c->buf == NULL
+			&& NULL == (c->buf = bufpool_get(&c->w->rbufs))) {
+			agg_err("no memory");
+			break;
+		}
+
+		int r = conn_io_recv(c, c->buf + c->bufn, agg_conf->rbuf_size - c->bufn);
 		if (r < 0) {
 			if (fferr_last() != FFSOCK_EINPROGRESS) {
 				agg_syserr("sock recv");
 				break;
 			}
+#ifndef FF_WIN // IOCP writes to the buffer asynchronously
+			if (c->bufn == 0)
+				conn_buf_release(c); // don't hold a buffer while waiting for the response
+#endif
 			agg_dbg("%p: receiving response", c);
 			conn_attach(c);
 			c->rhandler = conn_resp_recv;
+			conn_req_refill(c);
 			return;
 		} else if (r == 0) {
 			agg_err("server closed connection");
@@ -132,7 +613,11 @@ static void conn_resp_recv(struct conn *c)
 		}
 
 		c->bufn += r;
-		c->w->stats.total_recv += r;
+		c->w->st->total_recv += r;
+		c->recv_usec = time_usec();
+
+		if (c->tmr_kind == AGG_TO_TTFB && c->tmr.next != NULL)
+			conn_timer(c, AGG_TO_RESP, c->reqs[c->req_first].deadline);
 
 		agg_dbg("%p: response receive +%L", c, r);
 
@@ -144,74 +629,208 @@ static void conn_resp_recv(struct conn *c)
 		}
 
 		if (c->bufn == agg_conf->rbuf_size) {
-			agg_err("too large HTTP response");
-			break;
+			if (c->hdr_off == 0) {
+				agg_err("too large HTTP header line");
+				break;
+			}
+			// Discard the parsed lines to make room for the rest of the header
+			c->bufn -= c->hdr_off;
+			ffmem_move(c->buf, c->buf + c->hdr_off, c->bufn);
+			c->hdr_off = 0;
 		}
 	}
 
 	conn_end(c);
 }
 
-static int conn_resp_parse(struct conn *c)
+static void conn_verify_update(struct conn *c, const char *d, ffsize n)
 {
-	ffstr resp = FFSTR_INITN(c->buf, c->bufn), proto, msg;
-	uint code;
-	int r = http_resp_parse(resp, &proto, &code, &msg);
-	if (r < 0) {
-		agg_err("bad HTTP response line");
-		return -1;
-	} else if (r == 0) {
-		return 1;
-	}
-	ffstr_shift(&resp, r);
+	c->body_crc = crc32c(c->body_crc, d, n);
+	c->body_len += n;
+}
 
-	if (!c->resp_line_ok) {
-		c->resp_line_ok = 1;
-		ffuint64 t = time_usec();
-		c->w->stats.resp_latency_usec = (c->w->stats.resp_latency_usec + t - c->start_time_usec) / 2;
-	}
+/** Check the received body against the manifest */
+static int conn_verify_ok(struct conn *c)
+{
+	const struct agg_check *chk = &agg_conf->checks[c->reqs[c->req_first].ireq];
+	return c->body_len == chk->len
+		&& (!chk->with_crc || c->body_crc == chk->crc);
+}
 
-	ffstr name = {}, val = {};
+/** Parse the responses in the buffer.
+Parsing continues from the last complete line ('hdr_off') when more data is received.
+Return 0: the connection is handled by another function;
+ 1: need more data;
+ -1: error */
+static int conn_resp_parse(struct conn *c)
+{
 	for (;;) {
-		r = http_hdr_parse(resp, &name, &val);
-		if (r == 0) {
-			return 1;
-		} else if (r < 0) {
-			agg_err("bad HTTP header");
-			return -1;
+		ffstr resp = FFSTR_INITN(c->buf + c->hdr_off, c->bufn - c->hdr_off);
+		struct conn_req *rq = &c->reqs[c->req_first];
+		int r;
+
+		if (rq->first_usec == 0)
+			rq->first_usec = c->recv_usec; // the buffer holds data received at this time
+
+		if (!c->resp_line_ok) {
+			ffstr proto, msg;
+			uint code;
+			r = http_resp_parse(resp, &proto, &code, &msg);
+			if (r < 0) {
+				agg_err("bad HTTP response line");
+				return -1;
+			} else if (r == 0) {
+				return 1;
+			}
+			ffstr_shift(&resp, r);
+			c->hdr_off += r;
+
+			c->resp_line_ok = 1;
+			ffuint64 t = time_usec();
+			struct agg_stat *st = c->w->st;
+			ffuint64 lat = t - rq->start_usec;
+			hdrhist_add(&st->resp_latency, lat);
+			if (st->url_latency != NULL)
+				hdrhist_add(&st->url_latency[rq->ireq], lat);
+			hdrhist_add(&st->backends[c->ibackend].resp_latency, lat);
+			hdrhist_add(&st->class_latency[agg_status_class(code)], lat);
+			if (c->w->ivl != NULL)
+				hdrhist_add(&c->w->ivl[c->w->ivl_n % 2].resp_latency, lat);
+
+			c->resp_code = code;
+			if (code/100 == 4 || code/100 == 5)
+				c->resp_err = 1;
+			c->verify = (agg_conf->checks != NULL && agg_conf->checks[rq->ireq].enabled && code/100 == 2);
 		}
-		ffstr_shift(&resp, r);
 
-		if (r <= 2)
-			break;
+		ffstr name = {}, val = {};
+		for (;;) {
+			r = http_hdr_parse(resp, &name, &val);
+			if (r == 0) {
+				return 1;
+			} else if (r < 0) {
+				agg_err("bad HTTP header");
+				return -1;
+			}
+			ffstr_shift(&resp, r);
+			c->hdr_off += r;
+
+			if (r <= 2) {
+				rq->hdr_usec = c->recv_usec;
+				break;
+			}
+
+			switch (httpscan_hdr_id(name)) {
+			case HTTPSCAN_H_CONTENT_LENGTH:
+				if (!ffstr_to_uint64(&val, &c->cont_len)) {
+					agg_err("bad Content-Length");
+					return -1;
+				}
+				break;
+
+			case HTTPSCAN_H_TRANSFER_ENCODING: {
+				// "chunked" must be the last coding
+				ffstr coding, rest = val;
+				while (rest.len != 0) {
+					ffstr_splitby(&val, ',', &coding, &rest);
+					val = rest;
+					ffstr_trimwhite(&coding);
+					c->resp_chunked = ffstr_ieqz(&coding, "chunked");
+				}
+				break;
+			}
+			}
+		}
 
-		if (ffstr_ieqz(&name, "Content-Length")) {
-			if (!ffstr_to_uint64(&val, &c->cont_len)) {
-				agg_err("bad Content-Length");
+		if (c->resp_chunked) {
+			// Content-Length is ignored
+			r = conn_chunked(c, &resp);
+			if (r < 0)
 				return -1;
+			else if (r == 0)
+				goto body_recv;
+
+		} else {
+			if (resp.len < c->cont_len) {
+				if (c->verify)
+					conn_verify_update(c, resp.ptr, resp.len);
+				c->cont_len -= resp.len;
+				goto body_recv;
 			}
+
+			if (resp.len > c->cont_len && c->req_n == 1) {
+				agg_err("received data %L is larger than Content-Length %U"
+					, resp.len, c->cont_len);
+				return -1;
+			}
+			if (c->verify)
+				conn_verify_update(c, resp.ptr, c->cont_len);
+			ffstr_shift(&resp, c->cont_len);
 		}
-	}
 
-	if (resp.len > c->cont_len) {
-		agg_err("received data %L is larger than Content-Length %U"
-			, resp.len, c->cont_len);
-		return -1;
+		// The rest of data belongs to the next pipelined responses
+		if (resp.len != 0 && c->req_n == 1) {
+			agg_err("received %L bytes after the end of response", resp.len);
+			return -1;
+		}
+		ffmem_move(c->buf, resp.ptr, resp.len);
+		c->bufn = resp.len;
+		if (c->bufn == 0)
+			conn_buf_release(c);
+
+		if (0 != conn_resp_done(c))
+			return 0;
+		if (c->bufn == 0)
+			return 1;
 	}
-	c->cont_len -= resp.len;
-
-	if (code/100 == 4 || code/100 == 5)
-		c->resp_err = 1;
 
+body_recv:
+	c->bufn = 0;
+	conn_buf_release(c);
 	conn_respdata_recv(c);
 	return 0;
 }
 
+/** Skip chunked body data without copying it
+Return 1 if the body is complete;  'data' is shifted to the first byte after the body
+ 0: need more data
+ -1: error */
+static int conn_chunked(struct conn *c, ffstr *data)
+{
+	for (;;) {
+		ffstr out;
+		ffssize r = httpchunked_parse(&c->chunked, *data, &out);
+		if (r == -1) {
+			return 1;
+		} else if (r < 0) {
+			agg_err("bad chunked data");
+			return -1;
+		} else if (r == 0) {
+			return 0;
+		}
+		if (c->verify)
+			conn_verify_update(c, out.ptr, out.len);
+		ffstr_shift(data, r);
+	}
+}
+
 static void conn_respdata_recv(struct conn *c)
 {
-	while (c->cont_len != 0) {
-		uint n = ffmin(c->cont_len, agg_conf->rbuf_size);
-		int r = ffsock_recv_async(c->sk, c->buf, n, &c->kqtask);
+	for (;;) {
+		if (!c->resp_chunked && c->cont_len == 0)
+			break;
+
+		int r;
+		if (c->verify && !c->resp_chunked) {
+			r = conn_io_recv(c, c->w->rbuf_discard, ffmin(c->cont_len, AGG_DISCARD_BUF));
+			if (r > 0)
+				conn_verify_update(c, c->w->rbuf_discard, r);
+		} else if (!c->resp_chunked) {
+			r = conn_io_discard(c, ffmin(c->cont_len, 0x40000000));
+		} else {
+			// The chunk framing is parsed;  the data after the body is copied to a header buffer
+			r = conn_io_recv(c, c->w->rbuf_discard, agg_conf->rbuf_size);
+		}
 		if (r < 0) {
 			if (fferr_last() != FFSOCK_EINPROGRESS) {
 				agg_syserr("sock recv");
@@ -219,40 +838,136 @@ static void conn_respdata_recv(struct conn *c)
 			}
 			conn_attach(c);
 			c->rhandler = conn_respdata_recv;
+			conn_req_refill(c);
 			return;
 		} else if (r == 0) {
 			agg_err("server closed connection");
 			goto end;
 		}
 
-		c->cont_len -= r;
-		c->w->stats.total_recv += r;
-	}
+		c->w->st->total_recv += r;
+		c->recv_usec = time_usec();
 
-	if (c->resp_err)
-		c->w->stats.resp_err++;
-	else
-		c->w->stats.resp_ok++;
+		if (!c->resp_chunked) {
+			c->cont_len -= r;
+			continue;
+		}
 
-	agg_dbg("%p: response finished", c);
+		ffstr d = FFSTR_INITN(c->w->rbuf_discard, r);
+		r = conn_chunked(c, &d);
+		if (r < 0)
+			goto end;
+		else if (r == 0)
+			continue;
 
-	c->keepalive++;
-	if (c->keepalive == agg_conf->keepalive_reqs)
-		goto end;
+		if (d.len != 0) {
+			// The rest of data belongs to the next pipelined responses
+			if (c->req_n == 1) {
+				agg_err("received %L bytes after the end of response", d.len);
+				goto end;
+			}
+			if (NULL == (c->buf = bufpool_get(&c->w->rbufs))) {
+				agg_err("no memory");
+				goto end;
+			}
+			ffmem_copy(c->buf, d.ptr, d.len);
+			c->bufn = d.len;
+		}
+		break;
+	}
 
-	if (agg_conn_fin(c, 0))
+	if (0 != conn_resp_done(c))
 		return;
 
-	conn_prep(c);
-	conn_req_send(c);
+	if (c->bufn != 0) {
+		int r = conn_resp_parse(c);
+		if (r < 0)
+			goto end;
+		else if (r == 0)
+			return;
+	}
+	conn_resp_recv(c);
 	return;
 
 end:
 	conn_end(c);
 }
 
+/** Add the intervals between the time points of the finished request */
+static void conn_req_latency(struct agg_stat *st, const struct conn_req *rq, ffuint64 done)
+{
+	// The response may start before the request is fully written
+	ffuint64 sent = (rq->sent_usec != 0 && rq->sent_usec < rq->first_usec) ? rq->sent_usec : rq->first_usec;
+	hdrhist_add(&st->req_latency[AGG_LAT_SEND], sent - rq->start_usec);
+	hdrhist_add(&st->req_latency[AGG_LAT_TTFB], rq->first_usec - sent);
+	hdrhist_add(&st->req_latency[AGG_LAT_HEADER], rq->hdr_usec - rq->first_usec);
+	hdrhist_add(&st->req_latency[AGG_LAT_BODY], done - rq->hdr_usec);
+	hdrhist_add(&st->req_latency[AGG_LAT_TOTAL], done - rq->start_usec);
+}
+
+/** Account the finished response
+Return 0 if the next pipelined response should be received */
+static int conn_resp_done(struct conn *c)
+{
+	struct agg_stat *st = c->w->st;
+	const struct conn_req *rq = &c->reqs[c->req_first];
+	struct agg_url_stat *us = &st->urls[rq->ireq];
+	conn_req_latency(st, rq, c->recv_usec);
+	if (c->verify && !conn_verify_ok(c)) {
+		agg_dbg("%p: unexpected body: length %U  CRC32C %xu", c, c->body_len, c->body_crc);
+		st->verify_err++;
+		c->resp_err = 1;
+	}
+	st->status[c->resp_code]++;
+	us->classes[agg_status_class(c->resp_code)]++;
+	if (c->resp_err) {
+		st->resp_err++;
+		us->resp_err++;
+		st->backends[c->ibackend].resp_err++;
+	} else {
+		st->resp_ok++;
+		us->resp_ok++;
+		st->backends[c->ibackend].resp_ok++;
+	}
+
+	agg_dbg("%p: response finished", c);
+	c->req_first = (c->req_first + 1) % agg_conf->pipeline;
+	c->req_n--;
+	conn_resp_prep(c);
+
+	c->keepalive++;
+	if (c->keepalive == agg_conf->keepalive_reqs) {
+		conn_end(c);
+		return -1;
+	}
+
+	if (agg_conn_fin(c, 0))
+		return -1;
+
+	if (c->req_n != 0) {
+		conn_timer(c, AGG_TO_RESP, c->reqs[c->req_first].deadline);
+		return 0;
+	}
+
+	conn_timer(c, 0, 0);
+	c->recv_active = 0;
+	conn_req_next(c);
+	return 1;
+}
+
 void conn_close(struct conn *c)
 {
+	if (c->connected) {
+		c->connected = 0;
+		c->w->conns_open--;
+	}
+	conn_buf_release(c);
+	conn_idle_remove(c);
+	twheel_del(&c->w->timers, &c->tmr);
+#ifdef FF_LINUX
+	if (agg_conf->io_engine == AGG_IO_URING)
+		uring_close(c);
+#endif
 	ffsock_close(c->sk);  c->sk = FFSOCK_NULL;
 }
 
@@ -5,6 +5,10 @@
 #include <util/ipaddr.h>
 #include <util/http1.h>
 #include <FFOS/sysconf.h>
+#include <FFOS/file.h>
+#ifdef FF_UNIX
+#include <sys/mman.h>
+#endif
 
 #define CONF_RDONE  100
 
@@ -16,6 +20,68 @@ static int cmd_url(ffcmdarg_scheme *as, struct conf *c, ffstr *s)
 	return 0;
 }
 
+static int cmd_backend_weight(ffcmdarg_scheme *as, struct conf *c, ffstr *s)
+{
+	ffstr *p = ffvec_pushT(&c->backend_weights, ffstr);
+	ffmem_zero_obj(p);
+	ffstr_dupstr(p, s);
+	return 0;
+}
+
+/** Add local addresses: "IP[,IP...]" or "IPv4/PREFIX" (all host addresses of the network) */
+static int cmd_source(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	ffstr it, rest = *val;
+	while (rest.len != 0) {
+		ffstr in = rest, ip, prefix;
+		ffstr_splitby(&in, ',', &it, &rest);
+		ffstr_splitby(&it, '/', &ip, &prefix);
+
+		ffbyte a[16];
+		if (0 == ffip4_parse((void*)a, ip.ptr, ip.len)) {
+			uint bits = 32;
+			if (prefix.len != 0
+				&& (!ffstr_to_uint32(&prefix, &bits) || bits < 16 || bits > 32))
+				return FFCMDARG_ERROR;
+
+			uint n = 1U << (32 - bits);
+			uint first = (((uint)a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3]) & ~(n - 1);
+			if (n > 2) {
+				// Skip network and broadcast addresses
+				first++;
+				n -= 2;
+			}
+			for (uint i = 0;  i != n;  i++) {
+				uint v = first + i;
+				a[0] = v >> 24;  a[1] = v >> 16;  a[2] = v >> 8;  a[3] = v;
+				ffsockaddr *sa = ffvec_zpushT(&c->sources, ffsockaddr);
+				ffsockaddr_set_ipv4(sa, a, 0);
+			}
+
+		} else if (0 == ffip6_parse((void*)a, ip.ptr, ip.len) && prefix.len == 0) {
+			ffsockaddr *sa = ffvec_zpushT(&c->sources, ffsockaddr);
+			ffsockaddr_set_ipv6(sa, a, 0);
+
+		} else {
+			return FFCMDARG_ERROR;
+		}
+	}
+	return 0;
+}
+
+static int cmd_local_ports(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	ffstr lo, hi;
+	uint l, h;
+	ffstr_splitby(val, '-', &lo, &hi);
+	if (!ffstr_to_uint32(&lo, &l) || !ffstr_to_uint32(&hi, &h)
+		|| l == 0 || l > h || h > 0xffff)
+		return FFCMDARG_ERROR;
+	c->local_port_lo = l;
+	c->local_port_n = h - l + 1;
+	return 0;
+}
+
 static int cmd_header(ffcmdarg_scheme *as, struct conf *c, ffstr *s)
 {
 	ffvec_addfmt(&c->headers, "%S\r\n", s);
@@ -29,22 +95,169 @@ static int cmd_cpuaffinity(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
 	return 0;
 }
 
+static int cmd_arrival(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	ffstr name, params;
+	ffstr_splitby(val, ':', &name, &params);
+	if (ffstr_eqz(&name, "constant")) {
+		c->arrival = AGG_ARRIVAL_CONSTANT;
+	} else if (ffstr_eqz(&name, "poisson")) {
+		c->arrival = AGG_ARRIVAL_POISSON;
+	} else if (ffstr_eqz(&name, "onoff")) {
+		c->arrival = AGG_ARRIVAL_ONOFF;
+		ffstr on, off;
+		ffstr_splitby(&params, ':', &on, &off);
+		if (!ffstr_to_uint32(&on, &c->burst_on_msec)
+			|| !ffstr_to_uint32(&off, &c->burst_off_msec)
+			|| c->burst_on_msec == 0)
+			return FFCMDARG_ERROR;
+		return 0;
+	} else {
+		return FFCMDARG_ERROR;
+	}
+
+	if (params.len != 0)
+		return FFCMDARG_ERROR;
+	return 0;
+}
+
+static int cmd_engine(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	if (ffstr_eqz(val, "kq"))
+		c->io_engine = AGG_IO_KQ;
+#ifdef FF_LINUX
+	else if (ffstr_eqz(val, "io_uring"))
+		c->io_engine = AGG_IO_URING;
+#endif
+	else
+		return FFCMDARG_ERROR;
+	return 0;
+}
+
+static int cmd_interval_fmt(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	if (ffstr_eqz(val, "csv"))
+		c->interval_fmt = AGG_IVL_CSV;
+	else if (ffstr_eqz(val, "json"))
+		c->interval_fmt = AGG_IVL_JSON;
+	else
+		return FFCMDARG_ERROR;
+	return 0;
+}
+
+static int cmd_output(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	if (ffstr_eqz(val, "text"))
+		c->output = AGG_OUT_TEXT;
+	else if (ffstr_eqz(val, "json"))
+		c->output = AGG_OUT_JSON;
+	else
+		return FFCMDARG_ERROR;
+	return 0;
+}
+
+static int cmd_key_dist(ffcmdarg_scheme *as, struct conf *c, ffstr *val)
+{
+	ffstr name, params;
+	ffstr_splitby(val, ':', &name, &params);
+	if (ffstr_eqz(&name, "uniform") && params.len == 0) {
+		c->key_dist = AGG_KEY_UNIFORM;
+	} else if (ffstr_eqz(&name, "zipf")) {
+		c->key_dist = AGG_KEY_ZIPF;
+		c->key_zipf_s = 1;
+		if (params.len != 0
+			&& (!ffstr_to_float(&params, &c->key_zipf_s) || !(c->key_zipf_s > 0)))
+			return FFCMDARG_ERROR;
+	} else {
+		return FFCMDARG_ERROR;
+	}
+	return 0;
+}
+
 static int cmd_usage()
 {
 	static const char usage[] =
+"aggressor v" AGG_VER "\n"
 "aggressor [OPTIONS] URL...\n"
+"aggressor [OPTIONS] -s FILE\n"
 "URL: request URL (e.g. \"127.0.0.1:8080/file\")\n"
 " Host names here are NOT supported\n"
+" URLs may point to different servers: each connection is made to one of them (weighted round-robin)\n"
+"  and sends only the requests to its server\n"
 "Options:\n"
 " -n, --number N       Total number of requests (def: unlimited)\n"
 " -c, --concurrency N  Concurrent connectons (def: 100)\n"
 " -t, --threads N      Worker threads (def: CPU#)\n"
 " -a, --affinity N     CPU affinity bitmask, hex value (e.g. 15 for CPUs 0,2,4)\n"
+" -d, --duration N     Stop after N seconds of measurement (def: until -n requests are done or stopped)\n"
+"     --warmup N       Don't count the first N seconds of the run (def: 0)\n"
+"     --cooldown N     Keep running for N seconds after --duration without counting (def: 0)\n"
+" -w, --backend-weight HOST:PORT=N\n"
+"                      Share of connections to the server (def: 1 for each server)\n"
+"     --source LIST    Local addresses for the connections, used in turn:\n"
+"                       IP[,IP...] or IPv4/PREFIX (e.g. \"127.0.1.0/24\": 254 addresses)\n"
+"                       The kernel selects the port for each address separately (IP_BIND_ADDRESS_NO_PORT)\n"
+"     --local-ports LO-HI\n"
+"                      Bind to the ports from the range;  each thread uses its own part of the range.\n"
+"                       A port is used again after all ports of the thread and all --source addresses:\n"
+"                       connecting to the same server while the previous connection is in TIME_WAIT\n"
+"                       fails (EADDRNOTAVAIL) unless net.ipv4.tcp_tw_reuse=1\n"
 " -k, --keepalive N    Max. keep-alive requests per connection (def: 64)\n"
+" -P, --pipeline N     Send up to N requests on a connection without waiting for the responses (def: 1)\n"
+" -R, --rate N         Open-loop mode: send N requests/sec in total.\n"
+"                      Response latency is measured from the intended send time.\n"
+"     --arrival STR    Arrival process for open-loop mode:\n"
+"                        constant        Fixed intervals (def)\n"
+"                        poisson         Exponential inter-arrival times\n"
+"                        onoff:ON:OFF    Poisson bursts for ON msec, then silence for OFF msec\n"
+"     --seed N         Random seed for arrival times and weighted request selection\n"
+"                       (def: random; printed in the results)\n"
+"     --connect-timeout N\n"
+"                      Connection timeout, msec (def: 10000; 0:disable)\n"
+"     --ttfb-timeout N Time to the first byte of response after the request is sent, msec (def: 0; 0:disable)\n"
+"     --timeout N      Complete response timeout after the request is started, msec (def: 60000; 0:disable)\n"
+"     --idle-timeout N Close keep-alive connection that waits for the next request in open-loop mode, msec\n"
+"                       (def: 0; 0:disable)\n"
+"     --verify FILE    Check the length and CRC32C of 2xx response bodies; a mismatch is a failed response:\n"
+"                        # comment\n"
+"                        URL LENGTH [CRC32C]   (e.g. \"127.0.0.1:8080/a.css 1234 e3069283\")\n"
+"                        URL @FILE             (expected body is the file)\n"
+" -o, --output STR     Format of the results: text (def), json\n"
+" -i, --interval N     Print statistics for every N msec of the run (def: 0; 0:disable):\n"
+"                       responses/sec, bytes, errors, open connections, latency percentiles\n"
+"     --interval-format STR\n"
+"                      Format of the interval statistics: csv (def), json (one object per line)\n"
+"     --interval-output FILE\n"
+"                      Write the interval statistics to a file (def: stdout)\n"
 " -m, --method STR     HTTP request method (def: GET)\n"
 " -H, --header STR     Add HTTP request header\n"
+" -b, --body-file FILE Send the file as request body (e.g. with \"-m POST\");\n"
+"                       the file is mapped to memory once and sent without copying\n"
+" -K, --keys N         Keyspace size: \"{key}\" in request data is replaced with a number in [0..N)\n"
+"                       for each request (e.g. \"127.0.0.1:8080/obj/{key}\")\n"
+"     --key-dist STR   Popularity of keys:\n"
+"                        uniform         (def)\n"
+"                        zipf[:S]        Key K is requested with frequency 1/(K+1)^S (def S: 1.0)\n"
+" -s, --scenario FILE  Add requests from a file; each request is selected randomly according to its weight:\n"
+"                        # comment\n"
+"                        WEIGHT METHOD URL\n"
+"                          NAME: VALUE       (request header)\n"
+"                          < TEXT            (line of request body)\n"
+"     --engine STR     I/O engine:\n"
+"                        kq              epoll/kqueue/IOCP (def)\n"
+"                        io_uring        Linux 5.19+: batched submissions, provided buffers\n"
+"                                         (multishot recv on Linux 6.0+)\n"
 " -D, --debug          Debug logging\n"
 " -h, --help           Show help\n"
+"Variables in URL, headers and body are expanded for each request:\n"
+"  {seq}               Request number, unique across the threads\n"
+"  {rand:MIN-MAX}      Random number\n"
+"  {uuid}              Random UUID\n"
+"  {conn_id}           Connection number\n"
+"  {worker_id}         Thread number\n"
+"  {usec}              Microseconds since the start\n"
+"  {key}               Key from the keyspace (see -K)\n"
+"  Content-Length of a body with variables is computed for each request.\n"
 ;
 	ffstdout_write(usage, FFS_LEN(usage));
 	return CONF_RDONE;
@@ -56,9 +269,33 @@ static const ffcmdarg_arg cmd_args[] = {
 	{ 'c', "concurrency",	FFCMDARG_TINT32, FF_OFF(struct conf, connections_n) },
 	{ 't', "threads",	FFCMDARG_TINT32, FF_OFF(struct conf, threads) },
 	{ 'a', "affinity",	FFCMDARG_TSTR, (ffsize)cmd_cpuaffinity },
+	{ 'd', "duration",	FFCMDARG_TINT32, FF_OFF(struct conf, duration_sec) },
+	{ 0, "warmup",	FFCMDARG_TINT32, FF_OFF(struct conf, warmup_sec) },
+	{ 0, "cooldown",	FFCMDARG_TINT32, FF_OFF(struct conf, cooldown_sec) },
+	{ 'w', "backend-weight",	FFCMDARG_TSTR | FFCMDARG_FNOTEMPTY | FFCMDARG_FMULTI, (ffsize)cmd_backend_weight },
+	{ 0, "source",	FFCMDARG_TSTR | FFCMDARG_FNOTEMPTY | FFCMDARG_FMULTI, (ffsize)cmd_source },
+	{ 0, "local-ports",	FFCMDARG_TSTR, (ffsize)cmd_local_ports },
 	{ 'k', "keepalive",	FFCMDARG_TINT32, FF_OFF(struct conf, keepalive_reqs) },
+	{ 'P', "pipeline",	FFCMDARG_TINT32, FF_OFF(struct conf, pipeline) },
+	{ 'R', "rate",	FFCMDARG_TINT32, FF_OFF(struct conf, rate) },
+	{ 0, "arrival",	FFCMDARG_TSTR, (ffsize)cmd_arrival },
+	{ 0, "seed",	FFCMDARG_TINT64, FF_OFF(struct conf, seed) },
+	{ 0, "connect-timeout",	FFCMDARG_TINT32, FF_OFF(struct conf, connect_timeout_msec) },
+	{ 0, "ttfb-timeout",	FFCMDARG_TINT32, FF_OFF(struct conf, ttfb_timeout_msec) },
+	{ 0, "timeout",	FFCMDARG_TINT32, FF_OFF(struct conf, resp_timeout_msec) },
+	{ 0, "idle-timeout",	FFCMDARG_TINT32, FF_OFF(struct conf, idle_timeout_msec) },
+	{ 'o', "output",	FFCMDARG_TSTR, (ffsize)cmd_output },
+	{ 'i', "interval",	FFCMDARG_TINT32, FF_OFF(struct conf, interval_msec) },
+	{ 0, "interval-format",	FFCMDARG_TSTR, (ffsize)cmd_interval_fmt },
+	{ 0, "interval-output",	FFCMDARG_TSTRZ | FFCMDARG_FNOTEMPTY, FF_OFF(struct conf, interval_file) },
+	{ 'K', "keys",	FFCMDARG_TINT64, FF_OFF(struct conf, keys_n) },
+	{ 0, "key-dist",	FFCMDARG_TSTR, (ffsize)cmd_key_dist },
+	{ 'b', "body-file",	FFCMDARG_TSTRZ | FFCMDARG_FNOTEMPTY, FF_OFF(struct conf, body_file) },
+	{ 0, "verify",	FFCMDARG_TSTRZ | FFCMDARG_FNOTEMPTY, FF_OFF(struct conf, verify_file) },
+	{ 's', "scenario",	FFCMDARG_TSTRZ | FFCMDARG_FNOTEMPTY, FF_OFF(struct conf, scenario_file) },
 	{ 'm', "method",	FFCMDARG_TSTR | FFCMDARG_FNOTEMPTY, FF_OFF(struct conf, method) },
 	{ 'H', "header",	FFCMDARG_TSTR | FFCMDARG_FMULTI | FFCMDARG_FNOTEMPTY, (ffsize)cmd_header },
+	{ 0, "engine",	FFCMDARG_TSTR, (ffsize)cmd_engine },
 	{ 'D', "debug",	FFCMDARG_TSWITCH, FF_OFF(struct conf, debug) },
 	{ 'h', "help",	FFCMDARG_TSWITCH, (ffsize)cmd_usage },
 	{}
@@ -68,9 +305,12 @@ static void cmd_init(struct conf *c)
 {
 	c->total_reqs = 0x7fffffff;
 	c->keepalive_reqs = 64;
+	c->pipeline = 1;
 	c->connections_n = 100;
 	c->events_num = 512;
 	c->rbuf_size = 4096;
+	c->connect_timeout_msec = 10000;
+	c->resp_timeout_msec = 60000;
 	ffstr_dupz(&c->method, "GET");
 }
 
@@ -84,60 +324,631 @@ static void cmd_destroy(struct conf *c)
 	}
 	ffvec_free(&c->paths);
 
-	FFSLICE_WALK(&c->reqs, it) {
+	ffvec_free(&c->reqs);
+	ffvec_free(&c->req_data);
+	ffvec_free(&c->weights);
+
+	struct agg_backend *b;
+	FFSLICE_WALK(&c->backends, b) {
+		ffstr_free(&b->name);
+		ffvec_free(&b->reqs);
+		alias_free(&b->alias);
+	}
+	ffvec_free(&c->backends);
+	FFSLICE_WALK(&c->backend_weights, it) {
 		ffstr_free(it);
 	}
-	ffvec_free(&c->reqs);
+	ffvec_free(&c->backend_weights);
+	ffvec_free(&c->sources);
+	ffvec_free(&c->tpls);
+	ffvec_free(&c->segs);
+	ffmem_free(c->scenario_file);
+	ffmem_free(c->body_file);
+	ffmem_free(c->verify_file);
+	ffmem_free(c->checks);
+#ifdef FF_UNIX
+	if (c->body_data.len != 0)
+		munmap(c->body_data.ptr, c->body_data.len);
+#else
+	ffstr_free(&c->body_data);
+#endif
 
-	ffvec_free(&c->workers);
+	struct worker *w;
+	FFSLICE_WALK(&c->workers, w) {
+		for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+			stat_free(&w->stats[i]);
+		}
+	}
+	ffmem_alignfree(c->workers.ptr);
+	ffmem_free(c->interval_file);
 	ffstr_free(&c->method);
 }
 
-static int cmd_finalize(struct conf *c)
+/** Map the body file to memory: the pages are shared by all requests and never copied */
+static int cmd_body_load(struct conf *c)
 {
-	if (c->paths.len == 0) {
-		agg_err("URL is empty");
+	int rc = -1;
+	fffd f;
+	if (FFFILE_NULL == (f = fffile_open(c->body_file, FFFILE_READONLY))) {
+		agg_syserr("file open: %s", c->body_file);
+		return -1;
+	}
+
+	ffint64 size = fffile_size(f);
+	if (size <= 0) {
+		agg_err("%s: empty file", c->body_file);
+		goto end;
+	}
+
+#ifdef FF_UNIX
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
+	if (p == MAP_FAILED) {
+		agg_syserr("mmap: %s", c->body_file);
+		goto end;
+	}
+	ffstr_set(&c->body_data, p, size);
+
+#else
+	ffstr_alloc(&c->body_data, size);
+	for (ffsize off = 0;  off != (ffsize)size;  ) {
+		ffssize r = fffile_read(f, c->body_data.ptr + off, size - off);
+		if (r <= 0) {
+			agg_syserr("file read: %s", c->body_file);
+			goto end;
+		}
+		off += r;
+	}
+	c->body_data.len = size;
+#endif
+
+	rc = 0;
+
+end:
+	fffile_close(f);
+	return rc;
+}
+
+/** Find the next template variable: {NAME} or {NAME:PARAMS}
+Unknown names are not variables.
+Return offset of the variable;  'n' is set to its length
+ -1: not found
+ -2: bad parameters */
+static ffssize cmd_tpl_var(struct conf *c, ffstr s, struct agg_seg *sg, ffsize *n)
+{
+	static const char names[][10] = {
+		"key", "seq", "rand", "uuid", "conn_id", "worker_id", "usec", // enum AGG_VAR order
+	};
+	for (ffsize i = 0;  ;  i++) {
+		ffssize k = ffs_findchar(s.ptr + i, s.len - i, '{');
+		if (k < 0)
+			return -1;
+		i += k;
+
+		ffstr v = FFSTR_INITN(s.ptr + i + 1, s.len - i - 1);
+		ffssize e = ffstr_findchar(&v, '}');
+		if (e < 0)
+			return -1;
+		v.len = e;
+
+		ffstr name, params;
+		ffstr_splitby(&v, ':', &name, &params);
+		uint t;
+		for (t = 0;  t != FF_COUNT(names);  t++) {
+			if (ffstr_eqz(&name, names[t]))
+				break;
+		}
+		if (t == FF_COUNT(names))
+			continue;
+
+		ffmem_zero_obj(sg);
+		sg->type = AGG_V_KEY + t;
+		if (sg->type == AGG_V_KEY && c->keys_n == 0)
+			continue;
+
+		if (sg->type == AGG_V_RAND) {
+			ffstr min, max;
+			ffstr_splitby(&params, '-', &min, &max);
+			if (!ffstr_to_uint64(&min, &sg->min)
+				|| !ffstr_to_uint64(&max, &sg->max)
+				|| sg->min > sg->max) {
+				agg_err("bad variable: {%S}", &v);
+				return -2;
+			}
+		} else if (params.len != 0) {
+			agg_err("bad variable: {%S}", &v);
+			return -2;
+		}
+
+		*n = e + 2;
+		return i;
+	}
+}
+
+/** Add literal data segment */
+static void cmd_tpl_text(struct conf *c, struct agg_tpl *t, ffsize off, ffsize len)
+{
+	if (len == 0)
+		return;
+	if (t->seg_n != 0 && t->seg_n != t->body_seg) {
+		struct agg_seg *prev = ffslice_itemT(&c->segs, c->segs.len - 1, struct agg_seg);
+		if (prev->type == AGG_V_TEXT && prev->off + prev->len == off) {
+			prev->len += len;
+			return;
+		}
+	}
+	struct agg_seg *sg = ffvec_zpushT(&c->segs, struct agg_seg);
+	sg->type = AGG_V_TEXT;
+	sg->off = off;
+	sg->len = len;
+	t->seg_n++;
+}
+
+/** Add variable segment */
+static void cmd_tpl_push(struct conf *c, struct agg_tpl *t, const struct agg_seg *var)
+{
+	*ffvec_pushT(&c->segs, struct agg_seg) = *var;
+	t->seg_n++;
+	t->vars_size += (var->type == AGG_V_UUID) ? 36 : 20;
+}
+
+/** Compile the data in 'req_data' into literal and variable segments */
+static int cmd_tpl_compile(struct conf *c, struct agg_tpl *t, ffsize off, ffsize end)
+{
+	for (;;) {
+		ffstr s = FFSTR_INITN((char*)c->req_data.ptr + off, end - off);
+		struct agg_seg sg;
+		ffsize n;
+		ffssize r = cmd_tpl_var(c, s, &sg, &n);
+		if (r == -2)
+			return -1;
+		if (r < 0) {
+			cmd_tpl_text(c, t, off, s.len);
+			return 0;
+		}
+		cmd_tpl_text(c, t, off, r);
+		cmd_tpl_push(c, t, &sg);
+		off += r + n;
+	}
+}
+
+/** Add the request to the list of its server;  add the server if it's new */
+static int cmd_backend_add(struct conf *c, ffstr host, uint port)
+{
+	char ip[16];
+	ffsockaddr a = {};
+	if (0 == ffip4_parse((void*)ip, host.ptr, host.len)) {
+		ffsockaddr_set_ipv4(&a, ip, port);
+	} else if (0 == ffip6_parse((void*)ip, host.ptr, host.len)) {
+		ffsockaddr_set_ipv6(&a, ip, port);
+	} else {
+		agg_err("bad IP address");
 		return -1;
 	}
 
+	struct agg_backend *b;
+	FFSLICE_WALK(&c->backends, b) {
+		if (b->addr.len == a.len && !ffmem_cmp(&b->addr, &a, sizeof(a)))
+			goto done;
+	}
+
+	b = ffvec_zpushT(&c->backends, struct agg_backend);
+	b->addr = a;
+	ffsize cap = 0;
+	ffstr_growfmt(&b->name, &cap, "%S:%u", &host, port);
+	b->weight = 1;
+
+done:
+	*ffvec_pushT(&b->reqs, uint) = c->reqs.len;
+	return 0;
+}
+
+/** Apply --backend-weight values */
+static int cmd_backend_weights(struct conf *c)
+{
 	ffstr *it;
-	FFSLICE_WALK(&c->paths, it) {
-		struct httpurl_parts u = {};
-		httpurl_split(&u, *it);
-
-		uint port = 80;
-		if (u.port.len != 0) {
-			ffstr_shift(&u.port, 1);
-			if (!ffstr_to_uint32(&u.port, &port)
-				|| port == 0 || port > 0xffff) {
-				agg_err("bad port");
+	FFSLICE_WALK(&c->backend_weights, it) {
+		ffstr name, val;
+		uint w;
+		ffstr_splitby(it, '=', &name, &val);
+		if (!ffstr_to_uint32(&val, &w) || w == 0) {
+			agg_err("--backend-weight: bad value: %S", it);
+			return -1;
+		}
+
+		struct agg_backend *b, *found = NULL;
+		FFSLICE_WALK(&c->backends, b) {
+			if (ffstr_eq2(&b->name, &name)) {
+				found = b;
+				break;
+			}
+		}
+		if (found == NULL) {
+			agg_err("--backend-weight: no such server: %S", &name);
+			return -1;
+		}
+		found->weight = w;
+	}
+
+	struct agg_backend *b;
+	FFSLICE_WALK(&c->backends, b) {
+		c->backend_weights_total += b->weight;
+
+		// Weighted selection of the server's requests
+		if (c->scenario_file != NULL) {
+			ffvec w = {};
+			ffvec_allocT(&w, b->reqs.len, uint);
+			for (uint i = 0;  i != b->reqs.len;  i++) {
+				uint ireq = *ffslice_itemT(&b->reqs, i, uint);
+				*ffvec_pushT(&w, uint) = *ffslice_itemT(&c->weights, ireq, uint);
+			}
+			int r = alias_build(&b->alias, w.ptr, w.len);
+			ffvec_free(&w);
+			if (r != 0) {
+				agg_err("scenario: all weights for %S are 0", &b->name);
 				return -1;
 			}
 		}
+	}
+	return 0;
+}
+
+/** Add the request data to 'req_data'
+The pointers in 'reqs' are set after all requests are added. */
+static int cmd_req_add(struct conf *c, ffstr method, ffstr url, ffstr headers, ffstr body, uint weight)
+{
+	struct httpurl_parts u = {};
+	httpurl_split(&u, url);
+
+	uint port = 80;
+	if (u.port.len != 0) {
+		ffstr_shift(&u.port, 1);
+		if (!ffstr_to_uint32(&u.port, &port)
+			|| port == 0 || port > 0xffff) {
+			agg_err("bad port");
+			return -1;
+		}
+	}
+
+	if (0 != cmd_backend_add(c, u.host, port))
+		return -1;
+
+	if (u.path.len == 0)
+		ffstr_setz(&u.path, "/");
+
+	ffvec *d = &c->req_data;
+	ffsize off = d->len;
+	ffsize cap = method.len + u.path.len + 12;
+	ffvec_grow(d, cap, 1);
+	d->len += http_req_write((char*)d->ptr + d->len, cap, method, u.path, 0);
+	ffvec_addfmt(d, "Host: %S:%u\r\n", &u.host, port);
+	ffvec_add(d, headers.ptr, headers.len, 1);
+	ffvec_add(d, c->headers.ptr, c->headers.len, 1);
+
+	struct agg_tpl *t = ffvec_zpushT(&c->tpls, struct agg_tpl);
+	t->seg_first = c->segs.len;
+	t->body_seg = (uint)-1;
+
+	struct agg_seg sg;
+	ffsize n;
+	ffssize r = (body.len != 0) ? cmd_tpl_var(c, body, &sg, &n) : -1;
+	if (r == -2)
+		return -1;
+
+	if (r >= 0) {
+		// The body length is known only after its variables are expanded
+		ffvec_addsz(d, "Content-Length: ");
+		if (0 != cmd_tpl_compile(c, t, off, d->len))
+			return -1;
+		struct agg_seg cl = { .type = AGG_V_CLEN };
+		cmd_tpl_push(c, t, &cl);
+		ffsize crlf = d->len;
+		ffvec_addsz(d, "\r\n\r\n");
+		cmd_tpl_text(c, t, crlf, 4);
+
+		t->body_seg = t->seg_n;
+		ffsize body_off = d->len;
+		ffvec_add(d, body.ptr, body.len, 1);
+		if (0 != cmd_tpl_compile(c, t, body_off, d->len))
+			return -1;
+
+	} else if (body.len == 0 && c->body_data.len != 0) {
+		// The header and the beginning of the body are sent with one writev()
+		ffvec_addfmt(d, "Content-Length: %L\r\n\r\n", c->body_data.len);
+		if (0 != cmd_tpl_compile(c, t, off, d->len))
+			return -1;
+		struct agg_seg *fs = ffvec_zpushT(&c->segs, struct agg_seg);
+		fs->type = AGG_V_FILE;
+		t->seg_n++;
+
+	} else {
+		if (body.len != 0)
+			ffvec_addfmt(d, "Content-Length: %L\r\n", body.len);
+		ffvec_addsz(d, "\r\n");
+		ffvec_add(d, body.ptr, body.len, 1);
+		if (0 != cmd_tpl_compile(c, t, off, d->len))
+			return -1;
+	}
+
+	ffstr *rq = ffvec_pushT(&c->reqs, ffstr);
+	rq->ptr = NULL;
+	rq->len = d->len - off;
+	*ffvec_pushT(&c->weights, uint) = weight;
+	return 0;
+}
+
+/** Load the requests from a scenario file:
+# comment
+WEIGHT METHOD URL
+	NAME: VALUE
+	< BODY LINE
+*/
+static int cmd_scenario(struct conf *c)
+{
+	int rc = -1;
+	uint line_n = 0, weight = 0, n = c->paths.len;
+	ffvec data = {}, hdrs = {}, body = {};
+	ffstr method = {}, url = {};
+
+	if (0 != fffile_readwhole(c->scenario_file, &data, 64*1024*1024)) {
+		agg_syserr("file read: %s", c->scenario_file);
+		goto end;
+	}
+
+	ffstr d = FFSTR_INITN(data.ptr, data.len), ln, rest;
+	for (;;) {
+		int eof = (d.len == 0);
+		int indent = 0;
+		if (!eof) {
+			ffstr_splitby(&d, '\n', &ln, &rest);
+			d = rest;
+			line_n++;
+			indent = (ln.len != 0 && (ln.ptr[0] == ' ' || ln.ptr[0] == '\t'));
+			ffstr_trimwhite(&ln);
+			if (ln.len == 0 || ln.ptr[0] == '#')
+				continue;
+		}
+
+		if (indent) {
+			if (method.len == 0) {
+				agg_err("%s:%u: no request line", c->scenario_file, line_n);
+				goto end;
+			}
+			if (ln.ptr[0] == '<') {
+				ffstr_shift(&ln, 1);
+				ffstr_trimwhite(&ln);
+				if (body.len != 0)
+					ffvec_addchar(&body, '\n');
+				ffvec_add(&body, ln.ptr, ln.len, 1);
+			} else {
+				if (ffstr_findchar(&ln, ':') <= 0) {
+					agg_err("%s:%u: bad header", c->scenario_file, line_n);
+					goto end;
+				}
+				ffvec_addfmt(&hdrs, "%S\r\n", &ln);
+			}
+			continue;
+		}
+
+		if (method.len != 0) {
+			ffstr h = FFSTR_INITN(hdrs.ptr, hdrs.len), b = FFSTR_INITN(body.ptr, body.len);
+			if (0 != cmd_req_add(c, method, url, h, b, weight)) {
+				agg_err("%s: request before line %u", c->scenario_file, line_n);
+				goto end;
+			}
+			ffstr *p = ffvec_pushT(&c->paths, ffstr);
+			ffmem_zero_obj(p);
+			ffsize cap = 0;
+			ffstr_growfmt(p, &cap, "%S %S", &method, &url);
+			hdrs.len = body.len = 0;
+			ffstr_null(&method);
+		}
+		if (eof)
+			break;
+
+		ffstr w;
+		ffstr_splitby(&ln, ' ', &w, &rest);
+		ffstr_trimwhite(&rest);
+		ffstr_splitby(&rest, ' ', &method, &url);
+		ffstr_trimwhite(&url);
+		if (!ffstr_to_uint32(&w, &weight)
+			|| method.len == 0 || url.len == 0) {
+			agg_err("%s:%u: expected WEIGHT METHOD URL", c->scenario_file, line_n);
+			goto end;
+		}
+	}
+
+	if (c->paths.len == n) {
+		agg_err("%s: no requests", c->scenario_file);
+		goto end;
+	}
+	rc = 0;
+
+end:
+	ffvec_free(&data);
+	ffvec_free(&hdrs);
+	ffvec_free(&body);
+	return rc;
+}
+
+/** Load the expected response bodies:
+# comment
+URL LENGTH [CRC32C]
+URL @FILE
+*/
+static int cmd_verify_load(struct conf *c)
+{
+	int rc = -1;
+	uint line_n = 0, n = 0;
+	ffvec data = {}, fdata = {};
+	c->checks = ffmem_calloc(c->reqs.len, sizeof(struct agg_check));
+
+	if (0 != fffile_readwhole(c->verify_file, &data, 64*1024*1024)) {
+		agg_syserr("file read: %s", c->verify_file);
+		goto end;
+	}
+
+	ffstr d = FFSTR_INITN(data.ptr, data.len), ln, rest;
+	while (d.len != 0) {
+		ffstr_splitby(&d, '\n', &ln, &rest);
+		d = rest;
+		line_n++;
+		ffstr_trimwhite(&ln);
+		if (ln.len == 0 || ln.ptr[0] == '#')
+			continue;
+
+		ffstr url, len, crc;
+		ffstr_splitby(&ln, ' ', &url, &rest);
+		ffstr_trimwhite(&rest);
+		ffstr_splitby(&rest, ' ', &len, &crc);
+		ffstr_trimwhite(&crc);
+
+		struct agg_check chk = {};
+		chk.enabled = 1;
+		if (len.len != 0 && len.ptr[0] == '@') {
+			ffstr_shift(&len, 1);
+			char *fn = ffsz_dupstr(&len);
+			fdata.len = 0;
+			int r = fffile_readwhole(fn, &fdata, (ffuint64)-1);
+			if (r != 0)
+				agg_syserr("file read: %s", fn);
+			ffmem_free(fn);
+			if (r != 0)
+				goto end;
+			chk.len = fdata.len;
+			chk.crc = crc32c(0, fdata.ptr, fdata.len);
+			chk.with_crc = 1;
 
-		char ip[16];
-		if (0 == ffip4_parse((void*)ip, u.host.ptr, u.host.len)) {
-			ffsockaddr_set_ipv4(&agg_conf->addr, ip, port);
-		} else if (0 == ffip6_parse((void*)ip, u.host.ptr, u.host.len)) {
-			ffsockaddr_set_ipv6(&agg_conf->addr, ip, port);
 		} else {
-			agg_err("bad IP address");
+			if (!ffstr_to_uint64(&len, &chk.len)
+				|| (crc.len != 0 && !ffstr_toint(&crc, &chk.crc, FFS_INT32 | FFS_INTHEX))) {
+				agg_err("%s:%u: expected URL LENGTH [CRC32C]", c->verify_file, line_n);
+				goto end;
+			}
+			chk.with_crc = (crc.len != 0);
+		}
+
+		// Request names are "URL" or "METHOD URL" (scenario)
+		uint found = 0;
+		for (uint i = 0;  i != c->paths.len;  i++) {
+			ffstr name = *ffslice_itemT(&c->paths, i, ffstr), m;
+			if (ffstr_findchar(&name, ' ') >= 0)
+				ffstr_splitby(&name, ' ', &m, &name);
+			if (ffstr_eq2(&name, &url)) {
+				c->checks[i] = chk;
+				found++;
+			}
+		}
+		if (found == 0) {
+			agg_err("%s:%u: no such request: %S", c->verify_file, line_n, &url);
+			goto end;
+		}
+		n += found;
+	}
+
+	if (n == 0) {
+		agg_err("%s: no entries", c->verify_file);
+		goto end;
+	}
+	rc = 0;
+
+end:
+	ffvec_free(&data);
+	ffvec_free(&fdata);
+	return rc;
+}
+
+static int cmd_finalize(struct conf *c)
+{
+	if (c->paths.len == 0 && c->scenario_file == NULL) {
+		agg_err("URL is empty");
+		return -1;
+	}
+
+	if (c->body_file != NULL
+		&& 0 != cmd_body_load(c))
+		return -1;
+
+	ffstr *it;
+	ffstr none = {};
+	FFSLICE_WALK(&c->paths, it) {
+		if (0 != cmd_req_add(c, c->method, *it, none, none, 1))
+			return -1;
+	}
+
+	if (c->scenario_file != NULL
+		&& 0 != cmd_scenario(c))
+		return -1;
+
+	// The data buffer doesn't move anymore: set the pointers
+	const char *p = c->req_data.ptr;
+	FFSLICE_WALK(&c->reqs, it) {
+		it->ptr = (char*)p;
+		p += it->len;
+	}
+
+	uint nkeys = 0;
+	const struct agg_tpl *t;
+	FFSLICE_WALK(&c->tpls, t) {
+		c->req_segs_max = ffmax(c->req_segs_max, t->seg_n);
+		c->req_vars_max = ffmax(c->req_vars_max, t->vars_size);
+		const struct agg_seg *sg = ffslice_itemT(&c->segs, t->seg_first, struct agg_seg);
+		for (uint k = 0;  k != t->seg_n;  k++) {
+			nkeys += (sg[k].type == AGG_V_KEY);
+		}
+	}
+
+	if (c->keys_n != 0) {
+		if (nkeys == 0) {
+			agg_err("--keys: no \"{key}\" in requests");
 			return -1;
 		}
+		if (c->key_dist == AGG_KEY_ZIPF)
+			zipf_init(&c->key_zipf, c->keys_n, c->key_zipf_s);
+	}
 
-		if (u.path.len == 0)
-			ffstr_setz(&u.path, "/");
+	if (0 != cmd_backend_weights(c))
+		return -1;
 
-		ffstr *ps = ffvec_pushT(&c->reqs, ffstr);
-		ffmem_zero_obj(ps);
-		ffsize cap = 4096;
-		ffstr_alloc(ps, cap);
-		ps->len = http_req_write(ps->ptr, cap, agg_conf->method, u.path, 0);
-		ffstr_growfmt(ps, &cap, "Host: %S:%u\r\n", &u.host, port);
-		ffstr_growadd2(ps, &cap, &agg_conf->headers);
-		ffstr_growaddz(ps, &cap, "\r\n");
+	if (c->sources.len != 0) {
+		const struct agg_backend *b;
+		FFSLICE_WALK(&c->backends, b) {
+			const ffsockaddr *a, *found = NULL;
+			FFSLICE_WALK(&c->sources, a) {
+				if (a->ip4.sin_family == b->addr.ip4.sin_family) {
+					found = a;
+					break;
+				}
+			}
+			if (found == NULL) {
+				agg_err("--source: no address of the same IP family as %S", &b->name);
+				return -1;
+			}
+		}
 	}
 
+	if (c->verify_file != NULL
+		&& 0 != cmd_verify_load(c))
+		return -1;
+
+	if (c->arrival != AGG_ARRIVAL_CONSTANT && c->rate == 0) {
+		agg_err("--arrival requires --rate");
+		return -1;
+	}
+	if (c->cooldown_sec != 0 && c->duration_sec == 0) {
+		agg_err("--cooldown requires --duration");
+		return -1;
+	}
+	if (c->pipeline == 0) {
+		agg_err("--pipeline must be at least 1");
+		return -1;
+	}
+	if (c->pipeline > 1 && c->rate != 0) {
+		agg_err("--pipeline can't be used with --rate");
+		return -1;
+	}
+	if (c->seed == 0)
+		c->seed = time_usec();
+
 	if (c->threads == 0) {
 		ffsysconf sc;
 		ffsysconf_init(&sc);
@@ -146,6 +957,18 @@ static int cmd_finalize(struct conf *c)
 			c->cpumask = (uint)-1;
 	}
 
+	if (c->local_port_n != 0) {
+		// A port may be used by one connection of each local address at the same time
+		uint slice = c->local_port_n / c->threads;
+		if (slice * ffmax(c->sources.len, 1) < c->connections_n / c->threads) {
+			agg_err("--local-ports: the range is too small for %u connections", c->connections_n);
+			return -1;
+		}
+	}
+
+	// Small batches keep the total exact for small -n values, large batches make the global counter cold
+	c->quota_batch = ffmax(1, ffmin(1024, c->total_reqs / (c->threads * 16)));
+
 	if (c->connections_n > 1024)
 		c->fd_limit = c->connections_n * 2;
 	return 0;
@@ -0,0 +1,266 @@
+/** aggressor: time-series reporter
+*/
+
+#include <aggressor.h>
+#include <FFOS/file.h>
+#include <ffbase/atomic.h>
+
+/*
+A worker records the data of interval #k into its buffer 'ivl[k % 2]'.
+At the end of the interval the worker writes the totals of its counters into the buffer,
+ switches to the other (cleared) buffer and then publishes the number of finished intervals ('ivl_n').
+The reporter thread waits until all workers have published interval #k
+ and reads their buffers without locking.
+A buffer is written again at the end of the next interval:
+ the worker first marks it as unpublished ('index = -1'),
+ so a reporter that is late by an interval sees the change of 'index' after reading the buffer and discards the data;
+ the worker's counters are then reported with the next interval.
+The last (partial) interval is reported when the workers have stopped.
+*/
+
+struct reporter {
+	ffthread t;
+	uint stop;
+	fffd fd;
+	ffvec buf;
+	struct agg_counters *prev; // [worker] totals at the end of the previous interval
+	struct hdrhist resp_latency;
+	struct hdrhist tmp; // worker's data being read
+};
+static struct reporter *rep;
+
+static void ivl_totals(struct worker *w, struct agg_counters *t)
+{
+	ffmem_zero_obj(t);
+	for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+		const struct agg_stat *s = &w->stats[i];
+		t->resp_ok += s->resp_ok;
+		t->resp_err += s->resp_err;
+		t->total_sent += s->total_sent;
+		t->total_recv += s->total_recv;
+		// Idle keep-alive connections closed by timeout are not errors
+		t->timeouts += s->timeouts[AGG_TO_CONNECT] + s->timeouts[AGG_TO_TTFB] + s->timeouts[AGG_TO_RESP];
+	}
+	t->conns_open = w->conns_open;
+}
+
+int interval_update(struct worker *w, ffuint64 now_usec)
+{
+	ffuint64 ivl = agg_conf->interval_msec * 1000ULL;
+	ffuint64 t = now_usec - agg_conf->start_time_usec;
+	uint n = t / ivl;
+	if (n > w->ivl_n) {
+		struct agg_interval *cur = &w->ivl[w->ivl_n % 2];
+		cur->index = w->ivl_n;
+		ivl_totals(w, &cur->total);
+
+		struct agg_interval *next = &w->ivl[n % 2];
+		if (next == cur) {
+			// The worker is late for 2+ intervals: its counters will be reported with the next interval
+			cur->index = (uint)-1;
+		}
+		// The reporter may still be reading the buffer of the previous interval
+		FFINT_WRITEONCE(next->index, (uint)-1);
+		ffcpu_fence_release();
+		hdrhist_reset(&next->resp_latency);
+		ffcpu_fence_release();
+		FFINT_WRITEONCE(w->ivl_n, n);
+	}
+	return ((ffuint64)(n + 1) * ivl - t + 999) / 1000;
+}
+
+static void rep_header()
+{
+	if (agg_conf->interval_fmt == AGG_IVL_CSV)
+		ffvec_addsz(&rep->buf, "time_msec,rps,responses_ok,responses_err,timeouts,sent_bytes,recv_bytes,connections"
+			",latency_min,latency_50,latency_90,latency_99,latency_99.9,latency_max\n");
+}
+
+/**
+t_ms: time at the end of the interval
+dur_ms: interval duration */
+static void rep_line(ffuint64 t_ms, uint dur_ms, const struct agg_counters *d)
+{
+	const struct hdrhist *h = &rep->resp_latency;
+	ffuint64 rps = (d->resp_ok + d->resp_err) * 1000 / dur_ms;
+	ffuint64 lmin = (h->n != 0) ? h->min : 0;
+	const char *fmt = (agg_conf->interval_fmt == AGG_IVL_CSV)
+		? "%U,%U,%U,%U,%U,%U,%U,%U,%U,%U,%U,%U,%U,%U\n"
+		: "{\"time_msec\":%U,\"rps\":%U,\"responses_ok\":%U,\"responses_err\":%U,\"timeouts\":%U"
+			",\"sent_bytes\":%U,\"recv_bytes\":%U,\"connections\":%U"
+			",\"latency_usec\":{\"min\":%U,\"50\":%U,\"90\":%U,\"99\":%U,\"99.9\":%U,\"max\":%U}}\n";
+	ffvec_addfmt(&rep->buf, fmt
+		, t_ms, rps, d->resp_ok, d->resp_err, d->timeouts
+		, d->total_sent, d->total_recv, d->conns_open
+		, lmin
+		, hdrhist_value_at(h, 50)
+		, hdrhist_value_at(h, 90)
+		, hdrhist_value_at(h, 99)
+		, hdrhist_value_at(h, 99.9)
+		, h->max);
+}
+
+static void rep_flush()
+{
+	if (rep->buf.len == 0)
+		return;
+	fffile_write(rep->fd, rep->buf.ptr, rep->buf.len);
+	rep->buf.len = 0;
+}
+
+/** Sleep until the specified time
+Return 1 if the reporter is stopped */
+static int rep_sleep_until(ffuint64 t_usec)
+{
+	for (;;) {
+		if (FFINT_READONCE(rep->stop))
+			return 1;
+		ffuint64 now = time_usec();
+		if (now >= t_usec)
+			return 0;
+		ffthread_sleep(ffmin((t_usec - now + 999) / 1000, 100));
+	}
+}
+
+/** Add the worker's counters since the previous report */
+static void rep_diff(struct agg_counters *d, const struct agg_counters *total, struct agg_counters *prev)
+{
+	d->resp_ok += total->resp_ok - prev->resp_ok;
+	d->resp_err += total->resp_err - prev->resp_err;
+	d->timeouts += total->timeouts - prev->timeouts;
+	d->total_sent += total->total_sent - prev->total_sent;
+	d->total_recv += total->total_recv - prev->total_recv;
+	*prev = *total;
+}
+
+static void rep_interval(uint index)
+{
+	struct agg_counters d = {};
+	hdrhist_reset(&rep->resp_latency);
+
+	struct worker *w;
+	FFSLICE_WALK(&agg_conf->workers, w) {
+		struct agg_counters *prev = &rep->prev[w - (struct worker*)agg_conf->workers.ptr];
+		if (w->ivl == NULL)
+			continue;
+
+		uint n = FFINT_READONCE(w->ivl_n);
+		ffcpu_fence_acquire();
+		const struct agg_interval *iv = &w->ivl[index % 2];
+		if (n > index && FFINT_READONCE(iv->index) == index) {
+			hdrhist_reset(&rep->tmp);
+			hdrhist_merge(&rep->tmp, &iv->resp_latency);
+			struct agg_counters total = iv->total;
+			ffcpu_fence_acquire();
+			if (FFINT_READONCE(iv->index) == index) {
+				// The worker hasn't started reusing the buffer while it was read
+				hdrhist_merge(&rep->resp_latency, &rep->tmp);
+				rep_diff(&d, &total, prev);
+			}
+		}
+		d.conns_open += prev->conns_open;
+	}
+
+	rep_line((ffuint64)(index + 1) * agg_conf->interval_msec, agg_conf->interval_msec, &d);
+	rep_flush();
+}
+
+/** Report the data after the last complete interval #k-1
+The workers have stopped: their data is read directly */
+static void rep_final(uint k)
+{
+	ffuint64 t_ms = (time_usec() - agg_conf->start_time_usec) / 1000;
+	ffuint64 begin_ms = (ffuint64)k * agg_conf->interval_msec;
+	if (t_ms <= begin_ms)
+		return;
+
+	struct agg_counters d = {};
+	hdrhist_reset(&rep->resp_latency);
+
+	struct worker *w;
+	FFSLICE_WALK(&agg_conf->workers, w) {
+		struct agg_counters *prev = &rep->prev[w - (struct worker*)agg_conf->workers.ptr];
+		if (w->ivl == NULL)
+			continue;
+
+		// The current buffer and the one of interval #k if it's published
+		hdrhist_merge(&rep->resp_latency, &w->ivl[w->ivl_n % 2].resp_latency);
+		if (w->ivl_n > k)
+			hdrhist_merge(&rep->resp_latency, &w->ivl[(w->ivl_n + 1) % 2].resp_latency);
+
+		struct agg_counters total;
+		ivl_totals(w, &total);
+		rep_diff(&d, &total, prev);
+		d.conns_open += total.conns_open;
+	}
+
+	rep_line(t_ms, t_ms - begin_ms, &d);
+	rep_flush();
+}
+
+static int FFTHREAD_PROCCALL rep_func(void *param)
+{
+	ffuint64 ivl = agg_conf->interval_msec * 1000ULL;
+	// Give the workers a moment to publish: they are woken at the same time as the reporter
+	ffuint64 grace = ffmin(ivl / 4, 20000);
+
+	for (uint k = 0;  ;  k++) {
+		ffuint64 end = agg_conf->start_time_usec + (k + 1) * ivl;
+		if (rep_sleep_until(end + grace)) {
+			rep_final(k);
+			break;
+		}
+
+		// Wait for the workers that are late, but not longer than half an interval
+		struct worker *w;
+		FFSLICE_WALK(&agg_conf->workers, w) {
+			while (w->ivl != NULL
+				&& FFINT_READONCE(w->ivl_n) <= k
+				&& !FFINT_READONCE(w->worker_stop)
+				&& time_usec() < end + ivl / 2) {
+				ffthread_sleep(1);
+			}
+		}
+
+		rep_interval(k);
+	}
+	return 0;
+}
+
+int interval_start()
+{
+	rep = ffmem_new(struct reporter);
+	rep->fd = ffstdout;
+	if (agg_conf->interval_file != NULL) {
+		if (FFFILE_NULL == (rep->fd = fffile_open(agg_conf->interval_file, FFFILE_CREATE | FFFILE_TRUNCATE | FFFILE_WRITEONLY))) {
+			agg_syserr("file open: %s", agg_conf->interval_file);
+			return -1;
+		}
+	}
+	rep->prev = ffmem_calloc(agg_conf->workers.len, sizeof(struct agg_counters));
+
+	rep_header();
+	rep_flush();
+
+	if (FFTHREAD_NULL == (rep->t = ffthread_create(rep_func, NULL, 0))) {
+		agg_syserr("thread create");
+		return -1;
+	}
+	return 0;
+}
+
+void interval_stop()
+{
+	if (rep == NULL)
+		return;
+	if (rep->t != FFTHREAD_NULL) {
+		FFINT_WRITEONCE(rep->stop, 1);
+		ffthread_join(rep->t, -1, NULL);
+	}
+	if (rep->fd != ffstdout && rep->fd != FFFILE_NULL)
+		fffile_close(rep->fd);
+	ffvec_free(&rep->buf);
+	ffmem_free(rep->prev);
+	ffmem_free(rep);
+	rep = NULL;
+}
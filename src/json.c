@@ -0,0 +1,241 @@
+/** aggressor: results in JSON
+*/
+
+#include <aggressor.h>
+
+/*
+{
+	"version": "...",
+	"config": {...},
+	"time_msec": N,  // measurement phase
+	"responses_per_sec": N,
+	"sent_per_sec": N,  // bytes
+	"recv_per_sec": N,
+	"header_buffers_peak": N,
+	"phases": {
+		"warmup"|"measure"|"cooldown": {
+			"connections_ok": N,
+			...
+			"status_codes": {"200": N, ...},
+			"urls": [{
+				"url": "...", "responses_ok": N, "responses_err": N,
+				"status_classes": {"1xx": N, ...},
+				"latency_usec": {"response": {...}}  // up to AGG_URL_HIST_MAX URLs
+			}, ...],
+			"servers": [{
+				"server": "HOST:PORT", "connections_ok": N, "connections_failed": N,
+				"responses_ok": N, "responses_err": N,
+				"latency_usec": {"response": {...}}
+			}, ...],
+			"latency_usec": {
+				"connect"|"response"|"send"|"first_byte"|"header"|"body"|"total"|"response_2xx"|...: {
+					"count": N, "min": N, "mean": N, "max": N,
+					"percentiles": {"50": N, ...},
+					"buckets": [[LOWEST, WIDTH, COUNT], ...]  // non-empty only
+				}
+			}
+		}
+	}
+}
+*/
+
+static void json_str(ffvec *v, ffstr s)
+{
+	static const char hex[] = "0123456789abcdef";
+	ffvec_addchar(v, '"');
+	for (ffsize i = 0;  i != s.len;  i++) {
+		ffbyte c = s.ptr[i];
+		if (c == '"' || c == '\\') {
+			ffvec_addchar(v, '\\');
+			ffvec_addchar(v, c);
+		} else if (c < 0x20) {
+			ffvec_addsz(v, "\\u00");
+			ffvec_addchar(v, hex[c >> 4]);
+			ffvec_addchar(v, hex[c & 0x0f]);
+		} else {
+			ffvec_addchar(v, c);
+		}
+	}
+	ffvec_addchar(v, '"');
+}
+
+static void json_hist(ffvec *v, const char *name, const struct hdrhist *h)
+{
+	ffvec_addfmt(v, "\"%s\":{\"count\":%U,\"min\":%U,\"mean\":%U,\"max\":%U"
+		",\"percentiles\":{\"50\":%U,\"90\":%U,\"99\":%U,\"99.9\":%U,\"99.99\":%U}"
+		",\"buckets\":["
+		, name, h->n, (h->n != 0) ? h->min : 0ULL, hdrhist_mean(h), h->max
+		, hdrhist_value_at(h, 50)
+		, hdrhist_value_at(h, 90)
+		, hdrhist_value_at(h, 99)
+		, hdrhist_value_at(h, 99.9)
+		, hdrhist_value_at(h, 99.99));
+
+	const char *sep = "";
+	for (uint i = 0;  i != HDRHIST_N;  i++) {
+		if (h->counts[i] == 0)
+			continue;
+		ffvec_addfmt(v, "%s[%U,%U,%U]"
+			, sep, hdrhist_bucket_lowest(i), hdrhist_bucket_width(i), h->counts[i]);
+		sep = ",";
+	}
+	ffvec_addsz(v, "]}");
+}
+
+static void json_phase(ffvec *v, const char *name, const struct agg_stat *s)
+{
+	ffvec_addfmt(v, "\"%s\":{"
+		"\"connections_ok\":%U,\"connections_failed\":%U"
+		",\"responses_ok\":%U,\"responses_err\":%U,\"verify_failed\":%U"
+		",\"timeouts\":{\"connect\":%U,\"first_byte\":%U,\"response\":%U,\"idle\":%U}"
+		",\"sent_bytes\":%U,\"recv_bytes\":%U"
+		, name
+		, s->connections_ok, s->connections_failed
+		, s->resp_ok, s->resp_err, s->verify_err
+		, s->timeouts[AGG_TO_CONNECT], s->timeouts[AGG_TO_TTFB], s->timeouts[AGG_TO_RESP], s->timeouts[AGG_TO_IDLE]
+		, s->total_sent, s->total_recv);
+
+	ffvec_addsz(v, ",\"status_codes\":{");
+	const char *sep = "";
+	for (uint i = 0;  i != AGG_STATUS_N;  i++) {
+		if (s->status[i] == 0)
+			continue;
+		ffvec_addfmt(v, "%s\"%u\":%U", sep, i, s->status[i]);
+		sep = ",";
+	}
+
+	ffvec_addsz(v, "},\"urls\":[");
+	for (uint i = 0;  i != agg_conf->reqs.len;  i++) {
+		const struct agg_url_stat *u = &s->urls[i];
+		ffvec_addsz(v, (i != 0) ? ",{\"url\":" : "{\"url\":");
+		json_str(v, *ffslice_itemT(&agg_conf->paths, i, ffstr));
+		ffvec_addfmt(v, ",\"responses_ok\":%U,\"responses_err\":%U"
+			",\"status_classes\":{\"1xx\":%U,\"2xx\":%U,\"3xx\":%U,\"4xx\":%U,\"5xx\":%U,\"other\":%U}"
+			, u->resp_ok, u->resp_err
+			, u->classes[1], u->classes[2], u->classes[3], u->classes[4], u->classes[5], u->classes[0]);
+		if (s->url_latency != NULL) {
+			ffvec_addsz(v, ",\"latency_usec\":{");
+			json_hist(v, "response", &s->url_latency[i]);
+			ffvec_addchar(v, '}');
+		}
+		ffvec_addchar(v, '}');
+	}
+
+	ffvec_addsz(v, "],\"servers\":[");
+	for (uint i = 0;  i != agg_conf->backends.len;  i++) {
+		const struct agg_backend_stat *b = &s->backends[i];
+		ffvec_addsz(v, (i != 0) ? ",{\"server\":" : "{\"server\":");
+		json_str(v, ffslice_itemT(&agg_conf->backends, i, struct agg_backend)->name);
+		ffvec_addfmt(v, ",\"connections_ok\":%U,\"connections_failed\":%U"
+			",\"responses_ok\":%U,\"responses_err\":%U,\"latency_usec\":{"
+			, b->connections_ok, b->connections_failed, b->resp_ok, b->resp_err);
+		json_hist(v, "response", &b->resp_latency);
+		ffvec_addsz(v, "}}");
+	}
+
+	ffvec_addsz(v, "],\"latency_usec\":{");
+	json_hist(v, "connect", &s->connect_latency);
+	ffvec_addchar(v, ',');
+	json_hist(v, "response", &s->resp_latency);
+
+	static const char phases[][12] = { "send", "first_byte", "header", "body", "total" };
+	for (uint i = 0;  i != AGG_LAT_N;  i++) {
+		ffvec_addchar(v, ',');
+		json_hist(v, phases[i], &s->req_latency[i]);
+	}
+
+	static const char classes[][16] = {
+		"response_other", "response_1xx", "response_2xx", "response_3xx", "response_4xx", "response_5xx",
+	};
+	for (uint i = 0;  i != AGG_CLASS_N;  i++) {
+		if (s->class_latency[i].n == 0)
+			continue;
+		ffvec_addchar(v, ',');
+		json_hist(v, classes[i], &s->class_latency[i]);
+	}
+	ffvec_addsz(v, "}}");
+}
+
+static void json_config(ffvec *v)
+{
+	static const char arrivals[][9] = { "constant", "poisson", "onoff" };
+	static const char engines[][9] = { "kq", "io_uring" };
+	const struct conf *c = agg_conf;
+
+	ffvec_addsz(v, "\"config\":{\"urls\":[");
+	ffstr *it;
+	FFSLICE_WALK(&c->paths, it) {
+		if (it != (ffstr*)c->paths.ptr)
+			ffvec_addchar(v, ',');
+		json_str(v, *it);
+	}
+	if (c->scenario_file != NULL) {
+		ffvec_addsz(v, "],\"weights\":[");
+		for (uint i = 0;  i != c->weights.len;  i++) {
+			ffvec_addfmt(v, (i != 0) ? ",%u" : "%u", *ffslice_itemT(&c->weights, i, uint));
+		}
+	}
+	if (c->backends.len > 1) {
+		ffvec_addsz(v, "],\"servers\":[");
+		const struct agg_backend *b;
+		FFSLICE_WALK(&c->backends, b) {
+			if (b != (struct agg_backend*)c->backends.ptr)
+				ffvec_addchar(v, ',');
+			ffvec_addsz(v, "{\"server\":");
+			json_str(v, b->name);
+			ffvec_addfmt(v, ",\"weight\":%u}", b->weight);
+		}
+	}
+	ffvec_addsz(v, "],\"method\":");
+	json_str(v, c->method);
+
+	if (c->sources.len != 0)
+		ffvec_addfmt(v, ",\"sources\":%u", (uint)c->sources.len);
+	if (c->local_port_n != 0)
+		ffvec_addfmt(v, ",\"local_ports\":\"%u-%u\"", c->local_port_lo, c->local_port_lo + c->local_port_n - 1);
+
+	if (c->keys_n != 0) {
+		ffvec_addfmt(v, ",\"keys\":%U,\"key_dist\":\"%s\""
+			, c->keys_n, (c->key_dist == AGG_KEY_ZIPF) ? "zipf" : "uniform");
+		if (c->key_dist == AGG_KEY_ZIPF)
+			ffvec_addfmt(v, ",\"key_zipf_s\":%.3F", c->key_zipf_s);
+	}
+
+	ffvec_addfmt(v, ",\"threads\":%u,\"connections\":%u,\"requests\":%u,\"keepalive\":%u,\"pipeline\":%u"
+		",\"rate\":%u,\"arrival\":\"%s\",\"seed\":%U,\"engine\":\"%s\""
+		",\"warmup_sec\":%u,\"duration_sec\":%u,\"cooldown_sec\":%u"
+		",\"connect_timeout_msec\":%u,\"ttfb_timeout_msec\":%u,\"timeout_msec\":%u,\"idle_timeout_msec\":%u}"
+		, (uint)c->workers.len, c->connections_n, c->total_reqs, c->keepalive_reqs, c->pipeline
+		, c->rate, arrivals[c->arrival], c->seed, engines[c->io_engine]
+		, c->warmup_sec, c->duration_sec, c->cooldown_sec
+		, c->connect_timeout_msec, c->ttfb_timeout_msec, c->resp_timeout_msec, c->idle_timeout_msec);
+}
+
+void stats_json(const struct agg_stat *phases, ffuint64 t_ms, ffuint64 rbufs_peak)
+{
+	static const char names[][9] = { "warmup", "measure", "cooldown" };
+	const struct agg_stat *s = &phases[AGG_PHASE_MEASURE];
+	ffvec v = {};
+
+	ffvec_addsz(&v, "{\"version\":\"" AGG_VER "\",");
+	json_config(&v);
+
+	ffvec_addfmt(&v, ",\"time_msec\":%U,\"responses_per_sec\":%U,\"sent_per_sec\":%U,\"recv_per_sec\":%U"
+		",\"header_buffers_peak\":%U"
+		, t_ms
+		, (t_ms != 0) ? (s->resp_ok + s->resp_err) * 1000 / t_ms : 0ULL
+		, (t_ms != 0) ? s->total_sent * 1000 / t_ms : 0ULL
+		, (t_ms != 0) ? s->total_recv * 1000 / t_ms : 0ULL
+		, rbufs_peak);
+
+	ffvec_addsz(&v, ",\"phases\":{");
+	for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+		if (i != 0)
+			ffvec_addchar(&v, ',');
+		json_phase(&v, names[i], &phases[i]);
+	}
+	ffvec_addsz(&v, "}}\n");
+
+	ffstdout_write(v.ptr, v.len);
+	ffvec_free(&v);
+}
@@ -13,6 +13,7 @@
 #include <assert.h>
 
 int _ffcpu_features;
+int httpscan_cpu;
 struct conf *agg_conf;
 
 ffuint64 time_usec()
@@ -21,49 +22,278 @@ ffuint64 time_usec()
 	return t.sec*1000000 + t.nsec/1000;
 }
 
+static void stats_latency(const char *name, const struct hdrhist *h)
+{
+	ffstdout_fmt(
+		"%s:\n"
+		"  min:                  %20Uusec\n"
+		"  mean:                 %20Uusec\n"
+		"  50%%:                  %20Uusec\n"
+		"  90%%:                  %20Uusec\n"
+		"  99%%:                  %20Uusec\n"
+		"  99.9%%:                %20Uusec\n"
+		"  99.99%%:               %20Uusec\n"
+		"  max:                  %20Uusec\n"
+		, name
+		, (h->n != 0) ? h->min : 0ULL
+		, hdrhist_mean(h)
+		, hdrhist_value_at(h, 50)
+		, hdrhist_value_at(h, 90)
+		, hdrhist_value_at(h, 99)
+		, hdrhist_value_at(h, 99.9)
+		, hdrhist_value_at(h, 99.99)
+		, h->max);
+}
+
+static void stat_merge(struct agg_stat *s, const struct agg_stat *ws)
+{
+	s->total_sent += ws->total_sent;
+	s->total_recv += ws->total_recv;
+	s->connections_ok += ws->connections_ok;
+	s->connections_failed += ws->connections_failed;
+	s->resp_ok += ws->resp_ok;
+	s->resp_err += ws->resp_err;
+	s->verify_err += ws->verify_err;
+	for (uint i = 0;  i != AGG_TO_N;  i++) {
+		s->timeouts[i] += ws->timeouts[i];
+	}
+	hdrhist_merge(&s->connect_latency, &ws->connect_latency);
+	hdrhist_merge(&s->resp_latency, &ws->resp_latency);
+	for (uint i = 0;  i != AGG_STATUS_N;  i++) {
+		s->status[i] += ws->status[i];
+	}
+	for (uint i = 0;  i != AGG_CLASS_N;  i++) {
+		hdrhist_merge(&s->class_latency[i], &ws->class_latency[i]);
+	}
+	for (uint i = 0;  i != AGG_LAT_N;  i++) {
+		hdrhist_merge(&s->req_latency[i], &ws->req_latency[i]);
+	}
+	for (uint i = 0;  i != agg_conf->reqs.len;  i++) {
+		struct agg_url_stat *u = &s->urls[i];
+		const struct agg_url_stat *wu = &ws->urls[i];
+		u->resp_ok += wu->resp_ok;
+		u->resp_err += wu->resp_err;
+		for (uint k = 0;  k != AGG_CLASS_N;  k++) {
+			u->classes[k] += wu->classes[k];
+		}
+		if (s->url_latency != NULL)
+			hdrhist_merge(&s->url_latency[i], &ws->url_latency[i]);
+	}
+	for (uint i = 0;  i != agg_conf->backends.len;  i++) {
+		struct agg_backend_stat *b = &s->backends[i];
+		const struct agg_backend_stat *wb = &ws->backends[i];
+		b->connections_ok += wb->connections_ok;
+		b->connections_failed += wb->connections_failed;
+		b->resp_ok += wb->resp_ok;
+		b->resp_err += wb->resp_err;
+		hdrhist_merge(&b->resp_latency, &wb->resp_latency);
+	}
+}
+
+/** Print the intervals between the time points of a request */
+static void stats_req_latency(const struct agg_stat *s)
+{
+	static const char names[][16] = { "send:      ", "first byte:", "header:    ", "body:      ", "total:     " };
+	ffstdout_fmt("request latency:        50%%          90%%          99%%        99.9%%          max (usec)\n");
+	for (uint i = 0;  i != AGG_LAT_N;  i++) {
+		const struct hdrhist *h = &s->req_latency[i];
+		ffstdout_fmt("  %s  %12U %12U %12U %12U %12U\n"
+			, names[i]
+			, hdrhist_value_at(h, 50)
+			, hdrhist_value_at(h, 90)
+			, hdrhist_value_at(h, 99)
+			, hdrhist_value_at(h, 99.9)
+			, h->max);
+	}
+}
+
+/** Print responses by status code and by URL */
+static void stats_breakdown(const struct agg_stat *s)
+{
+	ffvec v = {};
+	ffvec_addsz(&v, "status codes:          ");
+	for (uint i = 0;  i != AGG_STATUS_N;  i++) {
+		if (s->status[i] != 0)
+			ffvec_addfmt(&v, "  %u:%U", i, s->status[i]);
+	}
+	ffvec_addchar(&v, '\n');
+
+	static const char classes[][6] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+	for (uint i = 0;  i != AGG_CLASS_N;  i++) {
+		const struct hdrhist *h = &s->class_latency[i];
+		if (h->n == 0)
+			continue;
+		ffvec_addfmt(&v, "%s latency:  50%%:%Uusec  99%%:%Uusec  99.9%%:%Uusec  max:%Uusec\n"
+			, classes[i]
+			, hdrhist_value_at(h, 50), hdrhist_value_at(h, 99), hdrhist_value_at(h, 99.9), h->max);
+	}
+
+	if (agg_conf->reqs.len > AGG_URL_HIST_MAX) {
+		ffvec_addfmt(&v, "URLs: %L (see JSON output for the statistics of each URL)\n"
+			, agg_conf->reqs.len);
+	} else if (agg_conf->reqs.len > 1) {
+		for (uint i = 0;  i != agg_conf->reqs.len;  i++) {
+			const struct agg_url_stat *u = &s->urls[i];
+			const struct hdrhist *h = &s->url_latency[i];
+			ffvec_addfmt(&v, "URL #%u %S\n"
+				"  responses:  ok:%U  failed:%U  (2xx:%U  3xx:%U  4xx:%U  5xx:%U)\n"
+				"  latency:  50%%:%Uusec  99%%:%Uusec  99.9%%:%Uusec  max:%Uusec\n"
+				, i + 1, ffslice_itemT(&agg_conf->paths, i, ffstr)
+				, u->resp_ok, u->resp_err
+				, u->classes[2], u->classes[3], u->classes[4], u->classes[5]
+				, hdrhist_value_at(h, 50), hdrhist_value_at(h, 99), hdrhist_value_at(h, 99.9), h->max);
+		}
+	}
+
+	if (agg_conf->backends.len > 1) {
+		for (uint i = 0;  i != agg_conf->backends.len;  i++) {
+			const struct agg_backend *b = ffslice_itemT(&agg_conf->backends, i, struct agg_backend);
+			const struct agg_backend_stat *bs = &s->backends[i];
+			const struct hdrhist *h = &bs->resp_latency;
+			ffvec_addfmt(&v, "server %S (weight %u)\n"
+				"  connections:  ok:%U  failed:%U\n"
+				"  responses:  ok:%U  failed:%U\n"
+				"  latency:  50%%:%Uusec  99%%:%Uusec  99.9%%:%Uusec  max:%Uusec\n"
+				, &b->name, b->weight
+				, bs->connections_ok, bs->connections_failed
+				, bs->resp_ok, bs->resp_err
+				, hdrhist_value_at(h, 50), hdrhist_value_at(h, 99), hdrhist_value_at(h, 99.9), h->max);
+		}
+	}
+
+	ffstdout_write(v.ptr, v.len);
+	ffvec_free(&v);
+}
+
 static void stats()
 {
-	struct agg_stat s = {};
+	struct agg_stat *phases = ffmem_calloc(AGG_PHASE_N, sizeof(struct agg_stat));
+	for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+		stat_alloc(&phases[i]);
+	}
+
+	ffuint64 rbufs_peak = 0;
 	struct worker *w;
 	FFSLICE_WALK(&agg_conf->workers, w) {
-		const struct agg_stat *ws = &w->stats;
-		s.total_sent += ws->total_sent;
-		s.total_recv += ws->total_recv;
-		s.connections_ok += ws->connections_ok;
-		s.connections_failed += ws->connections_failed;
-		s.resp_ok += ws->resp_ok;
-		s.resp_err += ws->resp_err;
-		s.connect_latency_usec += ws->connect_latency_usec;
-		s.resp_latency_usec += ws->resp_latency_usec;
-	}
-	s.connect_latency_usec /= agg_conf->workers.len;
-	s.resp_latency_usec /= agg_conf->workers.len;
-
-	ffuint64 t_ms = (time_usec() - agg_conf->start_time_usec) / 1000;
+		rbufs_peak += w->rbufs.used_peak;
+		for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+			stat_merge(&phases[i], &w->stats[i]);
+		}
+	}
+	const struct agg_stat *s = &phases[AGG_PHASE_MEASURE];
+
+	// Only the measurement phase counts
+	ffuint64 now = time_usec(), t_ms = 0;
+	ffuint64 measure_start = agg_conf->start_time_usec + agg_conf->warmup_sec * 1000000ULL;
+	if (agg_conf->duration_sec != 0)
+		now = ffmin64(now, measure_start + agg_conf->duration_sec * 1000000ULL);
+	if (now > measure_start)
+		t_ms = (now - measure_start) / 1000;
+
+	if (agg_conf->output == AGG_OUT_JSON) {
+		stats_json(phases, t_ms, rbufs_peak);
+		goto end;
+	}
+
 	ffstdout_fmt(
 		"time:                   %20Umsec\n"
 		"successful connections: %20U\n"
 		"failed connections:     %20U\n"
 		"successful responses:   %20U\n"
 		"failed responses:       %20U\n"
+		"timeouts:               %20U (connect:%U  first byte:%U  response:%U  idle:%U)\n"
 		"responses/sec:          %20Urps\n"
 		"total sent:             %20UB\n"
 		"total received:         %20UB\n"
 		"send/sec:               %20Ubps\n"
 		"receive/sec:            %20Ubps\n"
-		"connection latency:     %20Uusec\n"
-		"response latency:       %20Uusec\n"
-		"\n"
+		"header buffers peak:    %20U (%UKB)\n"
 		, t_ms
-		, s.connections_ok, s.connections_failed
-		, s.resp_ok, s.resp_err
-		, (t_ms != 0) ? (s.resp_ok + s.resp_err) * 1000 / t_ms : 0ULL
-		, s.total_sent, s.total_recv
-		, (t_ms != 0) ? s.total_sent*8 / t_ms : 0ULL
-		, (t_ms != 0) ? s.total_recv*8 / t_ms : 0ULL
-		, s.connect_latency_usec
-		, s.resp_latency_usec
+		, s->connections_ok, s->connections_failed
+		, s->resp_ok, s->resp_err
+		, s->timeouts[AGG_TO_CONNECT] + s->timeouts[AGG_TO_TTFB] + s->timeouts[AGG_TO_RESP]
+		, s->timeouts[AGG_TO_CONNECT], s->timeouts[AGG_TO_TTFB], s->timeouts[AGG_TO_RESP], s->timeouts[AGG_TO_IDLE]
+		, (t_ms != 0) ? (s->resp_ok + s->resp_err) * 1000 / t_ms : 0ULL
+		, s->total_sent, s->total_recv
+		, (t_ms != 0) ? s->total_sent*8 / t_ms : 0ULL
+		, (t_ms != 0) ? s->total_recv*8 / t_ms : 0ULL
+		, rbufs_peak, rbufs_peak * agg_conf->rbuf_size / 1024
 		);
+	if (agg_conf->checks != NULL)
+		ffstdout_fmt("unexpected bodies:      %20U\n", s->verify_err);
+	if (agg_conf->arrival != AGG_ARRIVAL_CONSTANT || agg_conf->scenario_file != NULL || agg_conf->keys_n != 0)
+		ffstdout_fmt("random seed:            %20U\n", agg_conf->seed);
+	ffuint64 excluded[AGG_PHASE_N];
+	for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+		excluded[i] = phases[i].resp_ok + phases[i].resp_err;
+	}
+	if (agg_conf->warmup_sec != 0 || agg_conf->cooldown_sec != 0)
+		ffstdout_fmt("excluded responses:     %20U (warmup:%U  cooldown:%U)\n"
+			, excluded[AGG_PHASE_WARMUP] + excluded[AGG_PHASE_COOLDOWN]
+			, excluded[AGG_PHASE_WARMUP], excluded[AGG_PHASE_COOLDOWN]);
+	stats_latency("connection latency", &s->connect_latency);
+	stats_latency("response latency", &s->resp_latency);
+	stats_req_latency(s);
+	stats_breakdown(s);
+	ffstdout_fmt("\n");
+
+end:
+	for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+		stat_free(&phases[i]);
+	}
+	ffmem_free(phases);
+}
+
+/** Take the next batch of requests from the global pool
+Return N of requests;  0 if the pool is empty */
+static uint quota_take()
+{
+	ffint64 n = ffint_fetch_add(&agg_conf->reqs_left, -(ffint64)agg_conf->quota_batch);
+	if (n <= 0)
+		return 0;
+	return ffmin(n, agg_conf->quota_batch);
+}
+
+/** Set the timeout to 'msec' if it's sooner
+msec: -1:none */
+static void timeout_min(int *timeout_msec, int msec)
+{
+	if (msec >= 0 && (*timeout_msec < 0 || msec < *timeout_msec))
+		*timeout_msec = msec;
+}
+
+/** Select the worker's statistics according to the current phase of a timed run;
+ stop the worker after the last phase
+Return N of msec until the next phase;  -1 if there are no more phases */
+static int phase_update(struct worker *w, ffuint64 now_usec)
+{
+	const struct conf *c = agg_conf;
+	ffuint64 t = now_usec - c->start_time_usec;
+	ffuint64 end = c->warmup_sec * 1000000ULL;
+	uint phase = AGG_PHASE_WARMUP;
+
+	if (t >= end) {
+		phase = AGG_PHASE_MEASURE;
+		if (c->duration_sec == 0) {
+			w->st = &w->stats[phase];
+			return -1;
+		}
+		end += c->duration_sec * 1000000ULL;
+
+		if (t >= end) {
+			phase = AGG_PHASE_COOLDOWN;
+			end += c->cooldown_sec * 1000000ULL;
+
+			if (t >= end) {
+				agg_dbg("worker: run time is over");
+				FFINT_WRITEONCE(w->worker_stop, 1);
+				return -1;
+			}
+		}
+	}
+
+	w->st = &w->stats[phase];
+	return (end - t + 999) / 1000;
 }
 
 #ifdef FF_LINUX
@@ -95,22 +325,107 @@ static int FFTHREAD_PROCCALL worker_func(void *param)
 	w->cpost = ffmem_new(struct conn);
 	w->post = ffkq_post_attach(w->kq, w->cpost);
 
+	uint iw = w - (struct worker*)agg_conf->workers.ptr;
+	w->index = iw;
+	xrand_seed(&w->rnd, agg_conf->seed + iw);
+
+	if (agg_conf->rate != 0) {
+		// Each worker sends rate/threads requests per second;
+		//  the workers' schedules are shifted relative to each other so that the total rate is even
+		w->sched_interval_nsec = 1000000000ULL * agg_conf->workers.len / agg_conf->rate;
+		w->sched_next_nsec = time_usec() * 1000 + w->sched_interval_nsec * iw / agg_conf->workers.len;
+		w->sched_burst_nsec = w->sched_next_nsec;
+	}
+
 	uint n = agg_conf->connections_n / agg_conf->workers.len;
-	w->connections = ffmem_alloc(n * (sizeof(struct conn) + agg_conf->rbuf_size));
-	char *ptr = (void*)w->connections;
+
+	if (agg_conf->local_port_n != 0) {
+		// The first workers get 1 more port each if the range isn't divided evenly
+		uint slice = agg_conf->local_port_n / agg_conf->workers.len;
+		uint rem = agg_conf->local_port_n % agg_conf->workers.len;
+		w->port_n = slice + (iw < rem);
+		w->port_first = agg_conf->local_port_lo + slice * iw + ffmin(iw, rem);
+	}
+
+	// A running worker always has quota for its next finished request
+	if (0 == (w->quota = quota_take())) {
+		agg_dbg("worker: no requests");
+		n = 0;
+		w->worker_stop = 1;
+	}
+
+#ifdef FF_LINUX
+	if (agg_conf->io_engine == AGG_IO_URING
+		&& n != 0 // a worker without connections doesn't run the event loop
+		&& 0 != uring_create(w, n))
+		return -1;
+#endif
+
+	bufpool_init(&w->rbufs, agg_conf->rbuf_size, 64);
+	w->rbuf_discard = ffmem_alloc(ffmax(agg_conf->rbuf_size, AGG_DISCARD_BUF));
+
+	twheel_init(&w->timers, time_usec() / 1000);
+
+	uint timed = (agg_conf->warmup_sec != 0 || agg_conf->duration_sec != 0);
+	w->st = &w->stats[AGG_PHASE_MEASURE];
+	if (timed)
+		phase_update(w, time_usec());
+
+	uint depth = agg_conf->pipeline;
+	w->connections = ffmem_alloc(n * sizeof(struct conn));
+	w->creqs = ffmem_alloc(n * depth * sizeof(struct conn_req));
+	uint segs = agg_conf->req_segs_max, vars = agg_conf->req_vars_max;
+	w->wq = ffmem_alloc(n * depth * segs * sizeof(ffstr));
+	w->iov = ffmem_alloc(n * depth * segs * sizeof(ffiovec));
+	w->vars = ffmem_alloc(n * depth * vars + 1);
+	w->next_req = ffmem_calloc(agg_conf->backends.len, sizeof(uint));
+	w->backend_cur = ffmem_calloc(agg_conf->backends.len, sizeof(int));
 	for (uint i = 0;  i != n;  i++) {
-		struct conn *c = (void*)ptr;
-		ptr += sizeof(struct conn) + agg_conf->rbuf_size;
+		struct conn *c = &w->connections[i];
+		c->index = i;
+		c->side = 0;
+		c->reqs = &w->creqs[i * depth];
+		c->wq = &w->wq[i * depth * segs];
+		c->iov = &w->iov[i * depth * segs];
+		for (uint k = 0;  k != depth;  k++) {
+			c->reqs[k].vars = &w->vars[(i * depth + k) * vars];
+		}
 		conn_start(c, w);
 	}
 
 	w->kevents = ffmem_alloc(agg_conf->events_num * sizeof(ffkq_event));
 
 	ffkq_time t;
-	ffkq_time_set(&t, -1);
 	while (!FFINT_READONCE(w->worker_stop)) {
+		int timeout_msec = -1;
+		if (timed) {
+			timeout_msec = phase_update(w, time_usec());
+			if (FFINT_READONCE(w->worker_stop))
+				break;
+		}
+		if (agg_conf->interval_msec != 0)
+			timeout_min(&timeout_msec, interval_update(w, time_usec()));
+		if (agg_conf->rate != 0)
+			timeout_min(&timeout_msec, conn_sched(w));
+		timeout_min(&timeout_msec, twheel_next(&w->timers));
+
+		if (FFINT_READONCE(w->worker_stop))
+			break; // a request sent by the scheduler has finished the quota
+
+#ifdef FF_LINUX
+		if (agg_conf->io_engine == AGG_IO_URING) {
+			if (0 != uring_process(w, timeout_msec))
+				return -1;
+			continue;
+		}
+#endif
+
+		ffkq_time_set(&t, timeout_msec);
 		int r = ffkq_wait(w->kq, w->kevents, agg_conf->events_num, t);
 
+		// Process the expired timers before the events so the handlers arm the new timers relative to the current time
+		twheel_advance(&w->timers, time_usec() / 1000);
+
 		for (int i = 0;  i < r;  i++) {
 			ffkq_event *ev = &w->kevents[i];
 			void *d = ffkq_event_data(ev);
@@ -141,28 +456,54 @@ static int FFTHREAD_PROCCALL worker_func(void *param)
 		}
 	}
 
-	ptr = (void*)w->connections;
 	for (uint i = 0;  i != n;  i++) {
-		struct conn *c = (void*)ptr;
-		ptr += sizeof(struct conn) + agg_conf->rbuf_size;
-		conn_close(c);
+		conn_close(&w->connections[i]);
 	}
+	ffmem_free(w->connections);
+	ffmem_free(w->creqs);
+	ffmem_free(w->wq);
+	ffmem_free(w->iov);
+	ffmem_free(w->vars);
+	ffmem_free(w->next_req);
+	ffmem_free(w->backend_cur);
+	bufpool_destroy(&w->rbufs);
+	ffmem_free(w->rbuf_discard);
 
+#ifdef FF_LINUX
+	uring_free(w);
+#endif
 	ffmem_free(w->kevents);
 	ffkq_close(w->kq);
 	agg_dbg("worker thread exit");
 	return 0;
 }
 
-static void run()
+static int run()
 {
 	agg_conf->start_time_usec = time_usec();
 
-	ffvec_allocT(&agg_conf->workers, agg_conf->threads, struct worker);
+	agg_conf->workers.ptr = ffmem_align(agg_conf->threads * sizeof(struct worker), AGG_CACHELINE);
 	ffmem_zero(agg_conf->workers.ptr, agg_conf->threads * sizeof(struct worker));
 	agg_conf->workers.len = agg_conf->threads;
+	agg_conf->reqs_left = agg_conf->total_reqs;
 	struct worker *w;
 	uint mask = agg_conf->cpumask;
+	FFSLICE_WALK(&agg_conf->workers, w) {
+		for (uint i = 0;  i != AGG_PHASE_N;  i++) {
+			stat_alloc(&w->stats[i]);
+		}
+		if (agg_conf->interval_msec != 0)
+			w->ivl = ffmem_calloc(2, sizeof(struct agg_interval));
+	}
+	if (agg_conf->interval_msec != 0
+		&& 0 != interval_start()) {
+		interval_stop();
+		FFSLICE_WALK(&agg_conf->workers, w) {
+			ffmem_free(w->ivl);
+		}
+		return -1;
+	}
+
 	FFSLICE_WALK(&agg_conf->workers, w) {
 
 		w->icpu = -1;
@@ -187,6 +528,13 @@ static void run()
 		if (w->t != FFTHREAD_NULL)
 			ffthread_join(w->t, -1, NULL);
 	}
+
+	interval_stop();
+	FFSLICE_WALK(&agg_conf->workers, w) {
+		ffmem_free(w->ivl);
+		w->ivl = NULL;
+	}
+	return 0;
 }
 
 void agg_stopall()
@@ -200,9 +548,16 @@ void agg_stopall()
 
 int agg_conn_fin(struct conn *c, int closed)
 {
-	uint n = ffint_fetch_add(&agg_conf->nreqs, 1);
-	if (n+1 >= agg_conf->total_reqs) {
-		agg_stopall();
+	struct worker *w = c->w;
+	if (w->quota == 0)
+		return 1; // the worker is stopping
+
+	w->quota--;
+	if (w->quota == 0
+		&& 0 == (w->quota = quota_take())) {
+		// The other workers finish their own quotas
+		agg_dbg("worker: no more requests");
+		FFINT_WRITEONCE(w->worker_stop, 1);
 		return 1;
 	}
 
@@ -219,12 +574,16 @@ static void sig_handler(struct ffsig_info *i)
 int main(int argc, char **argv)
 {
 	static const char appname[] = "aggressor v" AGG_VER "\n";
-	ffstdout_write(appname, FFS_LEN(appname));
+
+	httpscan_init();
 
 	agg_conf = ffmem_new(struct conf);
 	if (0 != cmd_process(agg_conf, argc, (const char **)argv))
 		goto end;
 
+	if (agg_conf->output == AGG_OUT_TEXT)
+		ffstdout_write(appname, FFS_LEN(appname)); // stdout contains only the JSON document otherwise
+
 #ifdef FF_UNIX
 	if (agg_conf->fd_limit != 0) {
 		struct rlimit rl;
@@ -240,7 +599,8 @@ int main(int argc, char **argv)
 	ffuint sigs = FFSIG_INT;
 	ffsig_subscribe(sig_handler, &sigs, 1);
 
-	run();
+	if (0 != run())
+		goto end;
 	stats();
 
 end:
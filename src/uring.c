@@ -0,0 +1,531 @@
+/** aggressor: io_uring I/O engine
+*/
+
+#include <aggressor.h>
+
+#ifdef FF_LINUX
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+/*
+. All SQEs prepared while handling events are submitted with one io_uring_enter() call
+   which also waits for the next completions.
+. Sockets are registered in the ring's file table (slot = connection index)
+   by IORING_OP_FILES_UPDATE linked to IORING_OP_CONNECT, so registration is batched too.
+. Data is received by a multishot recv into the worker's provided-buffer ring.
+   Linux < 6.0 rejects multishot recv with EINVAL:
+   then the engine switches to single-shot recv which is restarted after each completion.
+   Buffers are queued per connection until the connection handler reads them,
+   then returned to the ring.
+. Completions are moved from the ring to a local queue before they are handled,
+   so a handler may free the ring's space while it's waiting for a free SQE.
+*/
+
+#define URING_ENTRIES  4096
+
+enum URING_UD {
+	URING_UD_KQ, // worker's kqueue is signalled (agg_stopall())
+	URING_UD_IGNORE,
+};
+
+enum URING_OP {
+	UOP_CONNECT = 1,
+	UOP_SEND,
+	UOP_RECV,
+};
+
+enum URING_F {
+	URING_CONNECTING = 1,
+	URING_CONNECT_DONE = 2,
+	URING_SENDING = 4,
+	URING_SEND_DONE = 8,
+	URING_RECV = 0x10, // recv is active
+	URING_RECV_MULTI = 0x20, // the active recv is multishot
+};
+
+struct uring_buf {
+	uint len;
+	uint next; // next buffer ID + 1 in connection's queue;  0:last
+};
+
+struct uring {
+	int fd;
+	void *ring;
+	ffsize ring_size;
+
+	uint *sq_head, *sq_tail, *sq_array;
+	uint sq_mask, sq_entries;
+	uint sq_local_tail; // prepared but not yet published SQEs
+	struct io_uring_sqe *sqes;
+	ffsize sqes_size;
+
+	uint *cq_head, *cq_tail;
+	uint cq_mask;
+	struct io_uring_cqe *cqes;
+	ffvec cq_local; // struct io_uring_cqe[]: completions taken from the ring but not yet handled
+
+	// provided buffers
+	struct io_uring_buf_ring *br;
+	ffsize br_size;
+	uint br_entries;
+	ffushort br_tail;
+	char *bufs;
+	uint buf_size;
+	struct uring_buf *binfo;
+
+	struct msghdr *msgs; // [connection]  the kernel may read it after the SQE is submitted
+	uint recv_single; // multishot recv isn't supported (Linux < 6.0)
+};
+
+static int sys_uring_setup(uint entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, uint to_submit, uint min_complete, uint flags, const void *arg, ffsize argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(int fd, uint op, const void *arg, uint n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static ffuint64 conn_ud(struct conn *c, uint op)
+{
+	return (ffsize)c | (op << 1) | c->side;
+}
+
+/** Submit the published SQEs and wait for completions */
+static int uring_enter(struct uring *u, uint wait, int timeout_msec)
+{
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	uint n = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg = {};
+	if (wait && timeout_msec >= 0) {
+		ts.tv_sec = timeout_msec / 1000;
+		ts.tv_nsec = (timeout_msec % 1000) * 1000000;
+		arg.ts = (ffsize)&ts;
+	}
+
+	if (0 > sys_uring_enter(u->fd, n, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg))) {
+		int e = fferr_last();
+		if (e != ETIME && e != EINTR && e != EBUSY)
+			return -1;
+	}
+	return 0;
+}
+
+/** Move the completions from the ring to the local queue */
+static void uring_cq_take(struct uring *u)
+{
+	uint head = *u->cq_head;
+	uint tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (;  head != tail;  head++) {
+		*ffvec_pushT(&u->cq_local, struct io_uring_cqe) = u->cqes[head & u->cq_mask];
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/** Wait until the submission queue has room for N SQEs
+The kernel doesn't consume SQEs while the completion queue is full (EBUSY):
+ the completions are moved to the local queue to make room. */
+static int uring_sq_wait(struct uring *u, uint n)
+{
+	while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_entries - n) {
+		if (0 != uring_enter(u, 0, 0)) {
+			agg_syserr("io_uring_enter");
+			return -1;
+		}
+		uring_cq_take(u);
+	}
+	return 0;
+}
+
+/** Get a new zeroed SQE; submit the queue if it's full
+Return NULL on error */
+static struct io_uring_sqe* uring_sqe(struct uring *u)
+{
+	if (0 != uring_sq_wait(u, 1))
+		return NULL;
+
+	uint i = u->sq_local_tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+	ffmem_zero_obj(sqe);
+	u->sq_array[i] = i;
+	u->sq_local_tail++;
+	return sqe;
+}
+
+/** Return buffer to the kernel */
+static void uring_buf_recycle(struct uring *u, uint bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->br_entries - 1)];
+	b->addr = (ffsize)(u->bufs + (ffsize)bid * u->buf_size);
+	b->len = u->buf_size;
+	b->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+int uring_create(struct worker *w, uint nconn)
+{
+	struct uring *u = ffmem_new(struct uring);
+	w->uring = u;
+	u->fd = -1;
+
+	struct io_uring_params p = {};
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if (0 > (u->fd = sys_uring_setup(URING_ENTRIES, &p))
+		&& fferr_last() == EINVAL) {
+		// kernel < 6.1
+		ffmem_zero_obj(&p);
+		u->fd = sys_uring_setup(URING_ENTRIES, &p);
+	}
+	if (u->fd < 0) {
+		agg_syserr("io_uring_setup");
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+		|| !(p.features & IORING_FEAT_EXT_ARG)) {
+		agg_err("io_uring: kernel is too old");
+		return -1;
+	}
+
+	u->ring_size = ffmax(p.sq_off.array + p.sq_entries * sizeof(uint)
+		, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		agg_syserr("io_uring: mmap");
+		return -1;
+	}
+
+	char *r = u->ring;
+	u->sq_head = (uint*)(r + p.sq_off.head);
+	u->sq_tail = (uint*)(r + p.sq_off.tail);
+	u->sq_mask = *(uint*)(r + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (uint*)(r + p.sq_off.array);
+	u->sq_local_tail = *u->sq_tail;
+	u->cq_head = (uint*)(r + p.cq_off.head);
+	u->cq_tail = (uint*)(r + p.cq_off.tail);
+	u->cq_mask = *(uint*)(r + p.cq_off.ring_mask);
+	u->cqes = (void*)(r + p.cq_off.cqes);
+
+	// sparse file table: one slot per connection
+	int *fds = ffmem_alloc(nconn * sizeof(int));
+	for (uint i = 0;  i != nconn;  i++) {
+		fds[i] = -1;
+	}
+	int rc = sys_uring_register(u->fd, IORING_REGISTER_FILES, fds, nconn);
+	ffmem_free(fds);
+	if (rc < 0) {
+		agg_syserr("io_uring: register files");
+		return -1;
+	}
+	u->msgs = ffmem_calloc(nconn, sizeof(struct msghdr));
+
+	// provided buffers: enough for every connection to have 1 buffer in flight
+	u->br_entries = 256;
+	while (u->br_entries < nconn && u->br_entries < 4096) {
+		u->br_entries *= 2;
+	}
+	u->buf_size = agg_conf->rbuf_size;
+	u->br_size = u->br_entries * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (u->br == MAP_FAILED) {
+		agg_syserr("io_uring: mmap");
+		return -1;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (ffsize)u->br,
+		.ring_entries = u->br_entries,
+		.bgid = 0,
+	};
+	if (0 > sys_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		agg_syserr("io_uring: register buffer ring (Linux 5.19+ is required)");
+		return -1;
+	}
+	u->bufs = ffmem_alloc((ffsize)u->br_entries * u->buf_size);
+	u->binfo = ffmem_alloc(u->br_entries * sizeof(struct uring_buf));
+	for (uint i = 0;  i != u->br_entries;  i++) {
+		uring_buf_recycle(u, i);
+	}
+
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = w->kq;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_UD_KQ;
+	return 0;
+}
+
+void uring_free(struct worker *w)
+{
+	struct uring *u = w->uring;
+	if (u == NULL)
+		return;
+	if (u->br != NULL && u->br != MAP_FAILED)
+		munmap(u->br, u->br_size);
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->ring != NULL && u->ring != MAP_FAILED)
+		munmap(u->ring, u->ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	ffmem_free(u->bufs);
+	ffmem_free(u->binfo);
+	ffmem_free(u->msgs);
+	ffvec_free(&u->cq_local);
+	ffmem_free(u);
+	w->uring = NULL;
+}
+
+static void uring_complete(struct worker *w, const struct io_uring_cqe *cqe)
+{
+	struct uring *u = w->uring;
+	if (cqe->user_data == URING_UD_KQ || cqe->user_data == URING_UD_IGNORE)
+		return;
+
+	struct conn *c = (void*)(ffsize)(cqe->user_data & ~7ULL);
+	uint op = (cqe->user_data >> 1) & 3;
+	if ((cqe->user_data & 1) != c->side) {
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		return;
+	}
+
+	switch (op) {
+	case UOP_CONNECT:
+		c->ur_ops = (c->ur_ops & ~URING_CONNECTING) | URING_CONNECT_DONE;
+		c->ur_connect_res = cqe->res;
+		if (c->whandler != NULL)
+			c->whandler(c);
+		break;
+
+	case UOP_SEND:
+		c->ur_ops = (c->ur_ops & ~URING_SENDING) | URING_SEND_DONE;
+		c->ur_send_res = cqe->res;
+		if (c->whandler != NULL)
+			c->whandler(c);
+		break;
+
+	case UOP_RECV:
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			uint bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (cqe->res > 0) {
+				u->binfo[bid].len = cqe->res;
+				u->binfo[bid].next = 0;
+				if (c->ur_rq_last != 0)
+					u->binfo[c->ur_rq_last - 1].next = bid + 1;
+				else
+					c->ur_rq_first = bid + 1;
+				c->ur_rq_last = bid + 1;
+			} else {
+				uring_buf_recycle(u, bid);
+			}
+		}
+
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			// recv is finished;  it's restarted by the next uring_recv()
+			uint multi = c->ur_ops & URING_RECV_MULTI;
+			c->ur_ops &= ~(URING_RECV | URING_RECV_MULTI);
+			if (cqe->res == 0) {
+				c->ur_recv_err = -1;
+			} else if (cqe->res == -EINVAL && multi) {
+				if (!u->recv_single)
+					agg_dbg("io_uring: multishot recv isn't supported;  using single-shot recv");
+				u->recv_single = 1;
+			} else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+				c->ur_recv_err = -cqe->res;
+			}
+		}
+
+		if (c->rhandler != NULL)
+			c->rhandler(c);
+		break;
+	}
+}
+
+int uring_process(struct worker *w, int timeout_msec)
+{
+	struct uring *u = w->uring;
+	uint wait = (timeout_msec != 0
+		&& u->cq_local.len == 0
+		&& *u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE));
+	if (0 != uring_enter(u, wait, timeout_msec)) {
+		agg_syserr("io_uring_enter");
+		return -1;
+	}
+
+	twheel_advance(&w->timers, time_usec() / 1000);
+
+	// The handlers may add more completions to the queue while waiting for a free SQE
+	uring_cq_take(u);
+	for (ffsize i = 0;  i != u->cq_local.len;  i++) {
+		struct io_uring_cqe cqe = *ffslice_itemT(&u->cq_local, i, struct io_uring_cqe);
+		uring_complete(w, &cqe);
+	}
+	u->cq_local.len = 0;
+	return 0;
+}
+
+int uring_connect(struct conn *c, const ffsockaddr *addr)
+{
+	if (c->ur_ops & URING_CONNECT_DONE) {
+		c->ur_ops &= ~URING_CONNECT_DONE;
+		if (c->ur_connect_res < 0) {
+			fferr_set(-c->ur_connect_res);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!(c->ur_ops & URING_CONNECTING)) {
+		struct uring *u = c->w->uring;
+		// The linked SQEs must be submitted together
+		if (0 != uring_sq_wait(u, 2))
+			return -1;
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		sqe->opcode = IORING_OP_FILES_UPDATE;
+		sqe->fd = -1;
+		sqe->addr = (ffsize)&c->sk;
+		sqe->len = 1;
+		sqe->off = c->index;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = URING_UD_IGNORE;
+
+		sqe = uring_sqe(u);
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = c->index;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->addr = (ffsize)&addr->ip4;
+		sqe->off = (addr->ip4.sin_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+		sqe->user_data = conn_ud(c, UOP_CONNECT);
+		c->ur_ops |= URING_CONNECTING;
+	}
+
+	fferr_set(FFSOCK_EINPROGRESS);
+	return -1;
+}
+
+int uring_sendv(struct conn *c, ffiovec *iov, uint n)
+{
+	if (c->ur_ops & URING_SEND_DONE) {
+		c->ur_ops &= ~URING_SEND_DONE;
+		if (c->ur_send_res < 0) {
+			fferr_set(-c->ur_send_res);
+			return -1;
+		}
+		return c->ur_send_res;
+	}
+
+	if (!(c->ur_ops & URING_SENDING)) {
+		struct uring *u = c->w->uring;
+		struct msghdr *m = &u->msgs[c->index];
+		ffmem_zero_obj(m);
+		m->msg_iov = iov;
+		m->msg_iovlen = n;
+
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = c->index;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->addr = (ffsize)m;
+		sqe->len = 1;
+		sqe->user_data = conn_ud(c, UOP_SEND);
+		c->ur_ops |= URING_SENDING;
+	}
+
+	fferr_set(FFSOCK_EINPROGRESS);
+	return -1;
+}
+
+int uring_recv(struct conn *c, void *buf, ffsize cap)
+{
+	struct uring *u = c->w->uring;
+
+	if (c->ur_rq_first != 0) {
+		uint bid = c->ur_rq_first - 1;
+		struct uring_buf *b = &u->binfo[bid];
+		uint n = ffmin(cap, b->len - c->ur_rq_off);
+		if (buf != NULL)
+			ffmem_copy(buf, u->bufs + (ffsize)bid * u->buf_size + c->ur_rq_off, n);
+		c->ur_rq_off += n;
+		if (c->ur_rq_off == b->len) {
+			c->ur_rq_first = b->next;
+			if (c->ur_rq_first == 0)
+				c->ur_rq_last = 0;
+			c->ur_rq_off = 0;
+			uring_buf_recycle(u, bid);
+		}
+		return n;
+	}
+
+	if (c->ur_recv_err == -1)
+		return 0;
+	else if (c->ur_recv_err != 0) {
+		fferr_set(c->ur_recv_err);
+		return -1;
+	}
+
+	if (!(c->ur_ops & URING_RECV)) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = c->index;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = conn_ud(c, UOP_RECV);
+		c->ur_ops |= URING_RECV;
+		if (!u->recv_single) {
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			c->ur_ops |= URING_RECV_MULTI;
+		}
+	}
+
+	fferr_set(FFSOCK_EINPROGRESS);
+	return -1;
+}
+
+void uring_close(struct conn *c)
+{
+	struct uring *u = c->w->uring;
+	while (c->ur_rq_first != 0) {
+		uint bid = c->ur_rq_first - 1;
+		c->ur_rq_first = u->binfo[bid].next;
+		uring_buf_recycle(u, bid);
+	}
+	c->ur_rq_last = 0;
+
+	if (c->sk != FFSOCK_NULL) {
+		// Pending operations hold a reference to the socket: complete them now.
+		// Their CQEs are skipped because the connection's side is changed.
+		shutdown(c->sk, SHUT_RDWR);
+
+		static const int fd_null = -1;
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe == NULL)
+			return; // the slot is replaced by the next connection's socket
+		sqe->opcode = IORING_OP_FILES_UPDATE;
+		sqe->fd = -1;
+		sqe->addr = (ffsize)&fd_null;
+		sqe->len = 1;
+		sqe->off = c->index;
+		sqe->user_data = URING_UD_IGNORE;
+	}
+}
+
+#endif
@@ -0,0 +1,92 @@
+/** Weighted random selection in O(1): alias method (Vose)
+*/
+
+/*
+alias_build
+alias_sample
+alias_free
+*/
+
+/*
+Each of N columns holds its own item with probability 'prob[i]' and an alias item otherwise:
+	i = column chosen uniformly
+	return (u < prob[i]) ? i : alias[i]
+The table is built in O(N): columns with weight below the mean are filled up by the items above the mean.
+*/
+
+#pragma once
+#include <ffbase/base.h>
+
+struct alias_table {
+	ffuint n; // 0:empty
+	ffuint64 *prob; // [n] threshold for 32-bit uniform value;  2^32: always the column's own item
+	ffuint *alias; // [n]
+};
+
+/** Build the table from the weights
+Return 0 on success;  -1 if the sum of weights is 0 */
+static inline int alias_build(struct alias_table *t, const ffuint *weights, ffuint n)
+{
+	double sum = 0;
+	for (ffuint i = 0;  i != n;  i++) {
+		sum += weights[i];
+	}
+	if (sum == 0)
+		return -1;
+
+	double *scaled = (double*)ffmem_alloc(n * sizeof(double));
+	ffuint *small = (ffuint*)ffmem_alloc(n * 2 * sizeof(ffuint)), *large = small + n;
+	ffuint ns = 0, nl = 0;
+	t->prob = (ffuint64*)ffmem_alloc(n * sizeof(ffuint64));
+	t->alias = (ffuint*)ffmem_alloc(n * sizeof(ffuint));
+	t->n = n;
+
+	for (ffuint i = 0;  i != n;  i++) {
+		scaled[i] = (double)weights[i] * n / sum;
+		if (scaled[i] < 1)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
+	}
+
+	while (ns != 0 && nl != 0) {
+		ffuint s = small[--ns], l = large[nl - 1];
+		t->prob[s] = (ffuint64)(scaled[s] * 4294967296.0);
+		t->alias[s] = l;
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			nl--;
+			small[ns++] = l;
+		}
+	}
+
+	// The rest are full columns (or off by a rounding error)
+	while (nl != 0) {
+		ffuint i = large[--nl];
+		t->prob[i] = 1ULL << 32;
+		t->alias[i] = i;
+	}
+	while (ns != 0) {
+		ffuint i = small[--ns];
+		t->prob[i] = 1ULL << 32;
+		t->alias[i] = i;
+	}
+
+	ffmem_free(scaled);
+	ffmem_free(small);
+	return 0;
+}
+
+/** Select an item by a 64-bit uniform random value */
+static inline ffuint alias_sample(const struct alias_table *t, ffuint64 r)
+{
+	ffuint i = ((r >> 32) * t->n) >> 32;
+	return ((r & 0xffffffff) < t->prob[i]) ? i : t->alias[i];
+}
+
+static inline void alias_free(struct alias_table *t)
+{
+	ffmem_free(t->prob);  t->prob = NULL;
+	ffmem_free(t->alias);  t->alias = NULL;
+	t->n = 0;
+}
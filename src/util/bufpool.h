@@ -0,0 +1,70 @@
+/** Pool of fixed-size buffers
+*/
+
+/*
+bufpool_init bufpool_destroy
+bufpool_get bufpool_put
+*/
+
+#pragma once
+#include <ffbase/vector.h>
+
+/** Free buffers are kept in a LIFO list (linked through the buffers' own data)
+ so that the most recently used (cache-hot) buffer is reused first.
+Memory is allocated in chunks and is never returned until bufpool_destroy(). */
+struct bufpool {
+	ffvec chunks; // char*[]
+	void *free; // the last released buffer
+	ffsize buf_size;
+	ffuint chunk_bufs;
+	ffuint used, used_peak;
+};
+
+static inline void bufpool_init(struct bufpool *p, ffsize buf_size, ffuint chunk_bufs)
+{
+	ffmem_zero_obj(p);
+	p->buf_size = ffint_align_ceil2(buf_size, sizeof(void*));
+	p->chunk_bufs = chunk_bufs;
+}
+
+static inline void bufpool_destroy(struct bufpool *p)
+{
+	char **it;
+	FFSLICE_WALK(&p->chunks, it) {
+		ffmem_free(*it);
+	}
+	ffvec_free(&p->chunks);
+	p->free = NULL;
+}
+
+/** Get a buffer
+Return NULL on error */
+static inline void* bufpool_get(struct bufpool *p)
+{
+	if (p->free == NULL) {
+		char *chunk = ffmem_alloc(p->buf_size * p->chunk_bufs);
+		if (chunk == NULL)
+			return NULL;
+		*ffvec_pushT(&p->chunks, char*) = chunk;
+
+		for (ffuint i = p->chunk_bufs;  i != 0;  i--) {
+			void **b = (void**)(chunk + p->buf_size * (i - 1));
+			*b = p->free;
+			p->free = b;
+		}
+	}
+
+	void **b = p->free;
+	p->free = *b;
+	p->used++;
+	if (p->used > p->used_peak)
+		p->used_peak = p->used;
+	return b;
+}
+
+static inline void bufpool_put(struct bufpool *p, void *buf)
+{
+	*(void**)buf = p->free;
+	p->free = buf;
+	p->used--;
+}
@@ -0,0 +1,135 @@
+/** Log-linear (HDR-style) histogram of integer values
+*/
+
+/*
+hdrhist_reset
+hdrhist_add
+hdrhist_merge
+hdrhist_mean
+hdrhist_value_at
+hdrhist_bucket_index hdrhist_bucket_lowest hdrhist_bucket_width
+*/
+
+/*
+Values are grouped by magnitude (power of 2), and each magnitude is split into
+ HDRHIST_SUB/2 linear sub-buckets, so the bucket width is always <1/128 of its value.
+Values 0..255 are stored with exact precision.
+Values >= HDRHIST_MAX are stored in the last bucket.
+For microsecond values the tracked range is 1usec..67sec with ~0.8% precision.
+
+Index layout:
+	[0..256)                      v
+	[256..384)                    v>>1 + 128      v: 256..511
+	[384..512)                    v>>2 + 256      v: 512..1023
+	...
+*/
+
+#pragma once
+#include <ffbase/base.h>
+
+#define HDRHIST_SUB_BITS  8
+#define HDRHIST_SUB  (1U << HDRHIST_SUB_BITS)
+#define HDRHIST_HALF  (HDRHIST_SUB / 2)
+#define HDRHIST_MAX_BITS  26
+#define HDRHIST_MAX  (1ULL << HDRHIST_MAX_BITS)
+#define HDRHIST_N  ((HDRHIST_MAX_BITS - HDRHIST_SUB_BITS) * HDRHIST_HALF + HDRHIST_SUB)
+
+/** Histogram is owned by one writer thread.
+Readers may access it after the writer is finished. */
+struct hdrhist {
+	ffuint64 n;
+	ffuint64 sum;
+	ffuint64 min; // valid only if n != 0
+	ffuint64 max;
+	ffuint64 counts[HDRHIST_N];
+};
+
+static inline ffuint hdrhist_bucket_index(ffuint64 v)
+{
+	if (v < HDRHIST_SUB)
+		return v;
+	if (v >= HDRHIST_MAX)
+		return HDRHIST_N - 1;
+	ffuint shift = ffbit_rfind64(v) - HDRHIST_SUB_BITS; // position of the most significant bit - 7
+	return shift * HDRHIST_HALF + (ffuint)(v >> shift);
+}
+
+static inline ffuint64 hdrhist_bucket_lowest(ffuint i)
+{
+	if (i < HDRHIST_SUB)
+		return i;
+	ffuint shift = i / HDRHIST_HALF - 1;
+	return (ffuint64)(i - shift * HDRHIST_HALF) << shift;
+}
+
+static inline ffuint64 hdrhist_bucket_width(ffuint i)
+{
+	if (i < HDRHIST_SUB)
+		return 1;
+	return 1ULL << (i / HDRHIST_HALF - 1);
+}
+
+static inline void hdrhist_reset(struct hdrhist *h)
+{
+	ffmem_zero_obj(h);
+}
+
+static inline void hdrhist_add(struct hdrhist *h, ffuint64 v)
+{
+	h->counts[hdrhist_bucket_index(v)]++;
+	if (h->n == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->n++;
+	h->sum += v;
+}
+
+static inline void hdrhist_merge(struct hdrhist *dst, const struct hdrhist *src)
+{
+	if (src->n == 0)
+		return;
+	if (dst->n == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->n += src->n;
+	dst->sum += src->sum;
+	for (ffuint i = 0;  i != HDRHIST_N;  i++) {
+		dst->counts[i] += src->counts[i];
+	}
+}
+
+static inline ffuint64 hdrhist_mean(const struct hdrhist *h)
+{
+	if (h->n == 0)
+		return 0;
+	return h->sum / h->n;
+}
+
+/** Get the value below which the specified percentage of samples fall
+percent: 0..100
+Return the highest value equivalent to the bucket's range (never larger than the maximum sample) */
+static inline ffuint64 hdrhist_value_at(const struct hdrhist *h, double percent)
+{
+	if (h->n == 0)
+		return 0;
+
+	ffuint64 target = (ffuint64)(percent / 100 * h->n + 0.5);
+	if (target == 0)
+		target = 1;
+	if (target > h->n)
+		target = h->n;
+
+	ffuint64 total = 0;
+	for (ffuint i = 0;  i != HDRHIST_N;  i++) {
+		total += h->counts[i];
+		if (total >= target) {
+			ffuint64 v = hdrhist_bucket_lowest(i) + hdrhist_bucket_width(i) - 1;
+			if (v < h->min)
+				v = h->min;
+			return ffmin64(v, h->max);
+		}
+	}
+	return h->max;
+}
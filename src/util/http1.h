@@ -46,6 +46,7 @@ Example HTTPS request via HTTP proxy:
 
 #pragma once
 #include <ffbase/string.h>
+#include <util/httpscan.h>
 
 static int httpurl_escape(char *buf, ffsize cap, ffstr url);
 
@@ -135,7 +136,7 @@ static inline int http_resp_parse(ffstr resp, ffstr *proto, ffuint *code, ffstr
 {
 	const char *d = resp.ptr, *end = resp.ptr + resp.len;
 
-	int r = ffs_skip_ranges(d, end - d, "\x21\x7e", 2); // printable ANSI
+	int r = httpscan_skip_ranges(d, end - d, "\x21\x7e", 2); // printable ANSI
 	if (r < 0)
 		return 0;
 	if (r == 0 || d[r] != ' ')
@@ -143,7 +144,7 @@ static inline int http_resp_parse(ffstr resp, ffstr *proto, ffuint *code, ffstr
 	ffstr_set(proto, d, r);
 	d += r+1;
 
-	r = ffs_skip_ranges(d, end - d, "\x30\x39", 2); // "0-9"
+	r = httpscan_skip_ranges(d, end - d, "\x30\x39", 2); // "0-9"
 	if (r < 0)
 		return 0;
 	else if (r != 3 || d[r] != ' ')
@@ -151,7 +152,7 @@ static inline int http_resp_parse(ffstr resp, ffstr *proto, ffuint *code, ffstr
 	*code = (d[0] - '0') * 100 + (d[1] - '0') * 10 + d[2] - '0';
 	d += 4;
 
-	r = ffs_skip_ranges(d, end - d, "\x20\x7e", 2); // basic latin
+	r = httpscan_skip_ranges(d, end - d, "\x20\x7e", 2); // basic latin
 	if (r < 0)
 		return 0;
 	ffstr_set(msg, d, r);
@@ -181,7 +182,7 @@ static inline int http_hdr_parse(ffstr data, ffstr *name, ffstr *value)
 {
 	const char *d = data.ptr, *end = data.ptr+data.len;
 
-	int r = ffs_skip_ranges(d, end - d, "\x2d\x2d\x30\x39\x41\x5a\x61\x7a", 8); // "-0-9A-Za-z"
+	int r = httpscan_skip_ranges(d, end - d, "\x2d\x2d\x30\x39\x41\x5a\x61\x7a", 8); // "-0-9A-Za-z"
 	if (r < 0)
 		return 0;
 	else if (r == 0)
@@ -199,7 +200,7 @@ static inline int http_hdr_parse(ffstr data, ffstr *name, ffstr *value)
 		d++;
 	}
 
-	r = ffs_findany(d, end - d, "\r\n", 2);
+	r = httpscan_findcrlf(d, end - d);
 	if (r < 0)
 		return 0;
 	ffstr_set(value, d, r);
@@ -299,7 +300,9 @@ struct httpchunked {
 };
 
 /** Parse chunked data
-Return N of bytes processed, `output` contains unchunked data (if any)
+Return N of bytes processed, `output` contains unchunked data (if any);
+  the call that processes the last byte of chunked data returns its N of bytes
+  so the data that follows can be located
  -1 if done
  <0 on error */
 static inline ffssize httpchunked_parse(struct httpchunked *c, ffstr input, ffstr *output)
@@ -307,9 +310,12 @@ static inline ffssize httpchunked_parse(struct httpchunked *c, ffstr input, ffst
 	char *d = input.ptr;
 	ffsize i, len = input.len;
 	int st = c->state;
-	enum { I_SZ1, I_SZ, I_SZ_CR, I_DAT, I_DAT_CR };
+	enum { I_SZ1, I_SZ, I_SZ_CR, I_DAT, I_DAT_CR, I_DONE };
 	output->len = 0;
 
+	if (st == I_DONE)
+		return -1;
+
 	for (i = 0;  i != len;  i++) {
 		int ch = d[i];
 
@@ -351,7 +357,8 @@ static inline ffssize httpchunked_parse(struct httpchunked *c, ffstr input, ffst
 					st = I_DAT_CR;
 				} else if (ch == '\n') {
 					if (c->last_chunk) {
-						i = -1;
+						st = I_DONE;
+						i++;
 						goto end;
 					}
 					st = I_SZ;
@@ -371,7 +378,8 @@ static inline ffssize httpchunked_parse(struct httpchunked *c, ffstr input, ffst
 			if (ch != '\n')
 				return -2;
 			if (c->last_chunk) {
-				i = -1;
+				st = I_DONE;
+				i++;
 				goto end;
 			}
 			st = I_SZ;
@@ -0,0 +1,201 @@
+/** Vectorized search for HTTP/1 delimiters
+*/
+
+/*
+httpscan_init
+httpscan_skip_ranges
+httpscan_findcrlf
+httpscan_hdr_id
+*/
+
+/*
+The kernels are compiled with the target attribute, so the program doesn't require -msse4.2;
+ the implementation is selected at runtime by the flags in httpscan_cpu.
+Data is processed in whole vectors; the tail is copied to a zeroed vector on stack,
+ so no byte past the end of data is ever read.
+	SSE4.2: PCMPESTRI with up to 8 byte ranges or up to 16 bytes to find
+	AVX2: 32 bytes per iteration, compare with CR and LF
+*/
+
+#pragma once
+#include <ffbase/string.h>
+
+#if defined __x86_64__ || defined __i386__
+	#define HTTPSCAN_X86
+	#include <immintrin.h>
+#endif
+
+enum HTTPSCAN_CPU {
+	HTTPSCAN_SSE42 = 1,
+	HTTPSCAN_AVX2 = 2,
+};
+
+/** enum HTTPSCAN_CPU;  set by httpscan_init() */
+extern int httpscan_cpu;
+
+/** Detect CPU features */
+static inline void httpscan_init()
+{
+#ifdef HTTPSCAN_X86
+	__builtin_cpu_init();
+	int f = 0;
+	if (__builtin_cpu_supports("sse4.2"))
+		f |= HTTPSCAN_SSE42;
+	if (__builtin_cpu_supports("avx2"))
+		f |= HTTPSCAN_AVX2;
+	httpscan_cpu = f;
+#endif
+}
+
+#ifdef HTTPSCAN_X86
+
+#define _HTTPSCAN_RANGES  (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_MASKED_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT)
+#define _HTTPSCAN_ANY  (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT)
+
+__attribute__((target("sse4.2")))
+static ffssize _httpscan_skip_ranges_sse42(const char *d, ffsize len, const char *ranges, ffsize ranges_len)
+{
+	char rb[16] = {};
+	ffmem_copy(rb, ranges, ranges_len);
+	__m128i r = _mm_loadu_si128((void*)rb);
+
+	ffsize i = 0;
+	for (;  i + 16 <= len;  i += 16) {
+		__m128i v = _mm_loadu_si128((void*)(d + i));
+		int k = _mm_cmpestri(r, ranges_len, v, 16, _HTTPSCAN_RANGES);
+		if (k != 16)
+			return i + k;
+	}
+
+	if (i != len) {
+		char tail[16] = {};
+		ffmem_copy(tail, d + i, len - i);
+		__m128i v = _mm_loadu_si128((void*)tail);
+		int k = _mm_cmpestri(r, ranges_len, v, len - i, _HTTPSCAN_RANGES);
+		if (k != 16)
+			return i + k;
+	}
+	return -1;
+}
+
+__attribute__((target("sse4.2")))
+static ffssize _httpscan_findcrlf_sse42(const char *d, ffsize len)
+{
+	const char crlf[16] = "\r\n";
+	__m128i n = _mm_loadu_si128((void*)crlf);
+
+	ffsize i = 0;
+	for (;  i + 16 <= len;  i += 16) {
+		__m128i v = _mm_loadu_si128((void*)(d + i));
+		int k = _mm_cmpestri(n, 2, v, 16, _HTTPSCAN_ANY);
+		if (k != 16)
+			return i + k;
+	}
+
+	if (i != len) {
+		char tail[16] = {};
+		ffmem_copy(tail, d + i, len - i);
+		__m128i v = _mm_loadu_si128((void*)tail);
+		int k = _mm_cmpestri(n, 2, v, len - i, _HTTPSCAN_ANY);
+		if (k != 16)
+			return i + k;
+	}
+	return -1;
+}
+
+__attribute__((target("avx2")))
+static ffssize _httpscan_findcrlf_avx2(const char *d, ffsize len)
+{
+	const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+
+	ffsize i = 0;
+	for (;;) {
+		__m256i v;
+		if (i + 32 <= len) {
+			v = _mm256_loadu_si256((void*)(d + i));
+		} else if (i != len) {
+			char tail[32] = {}; // zero bytes never match
+			ffmem_copy(tail, d + i, len - i);
+			v = _mm256_loadu_si256((void*)tail);
+		} else {
+			break;
+		}
+
+		ffuint m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+		if (m != 0)
+			return i + __builtin_ctz(m);
+		i += ffmin(32, len - i);
+	}
+	return -1;
+}
+
+#endif // HTTPSCAN_X86
+
+/** Find the first byte that doesn't belong to any of the ranges
+ranges: pairs of the lowest and the highest byte values;  up to 8 pairs
+Return index;  -1 if all bytes are within the ranges */
+static inline ffssize httpscan_skip_ranges(const char *d, ffsize len, const char *ranges, ffsize ranges_len)
+{
+#ifdef HTTPSCAN_X86
+	if (httpscan_cpu & HTTPSCAN_SSE42)
+		return _httpscan_skip_ranges_sse42(d, len, ranges, ranges_len);
+#endif
+	return ffs_skip_ranges(d, len, ranges, ranges_len);
+}
+
+/** Find the first CR or LF byte
+Return index;  -1 if not found */
+static inline ffssize httpscan_findcrlf(const char *d, ffsize len)
+{
+#ifdef HTTPSCAN_X86
+	if (httpscan_cpu & HTTPSCAN_AVX2)
+		return _httpscan_findcrlf_avx2(d, len);
+	if (httpscan_cpu & HTTPSCAN_SSE42)
+		return _httpscan_findcrlf_sse42(d, len);
+#endif
+	return ffs_findany(d, len, "\r\n", 2);
+}
+
+
+enum HTTPSCAN_HDR {
+	HTTPSCAN_H_UNKNOWN,
+	HTTPSCAN_H_CONTENT_LENGTH,
+	HTTPSCAN_H_TRANSFER_ENCODING,
+};
+
+/** Compare with a lower-case string by 8-byte words;  n >= 8
+The name must contain only "-0-9A-Za-z" (as validated by http_hdr_parse()):
+ then setting bit 0x20 changes only the upper-case letters. */
+static inline int _httpscan_ieq8(const char *d, const char *lower, ffsize n)
+{
+	const ffuint64 mask = 0x2020202020202020ULL;
+	ffuint64 a, b, diff = 0;
+	ffsize i;
+	for (i = 0;  i + 8 < n;  i += 8) {
+		ffmem_copy(&a, d + i, 8);
+		ffmem_copy(&b, lower + i, 8);
+		diff |= (a | mask) ^ b;
+	}
+	// the last word overlaps the previous one
+	ffmem_copy(&a, d + n - 8, 8);
+	ffmem_copy(&b, lower + n - 8, 8);
+	diff |= (a | mask) ^ b;
+	return diff == 0;
+}
+
+/** Identify the header field name (case-insensitive)
+Return enum HTTPSCAN_HDR */
+static inline ffuint httpscan_hdr_id(ffstr name)
+{
+	switch (name.len) {
+	case 14:
+		if (_httpscan_ieq8(name.ptr, "content-length", 14))
+			return HTTPSCAN_H_CONTENT_LENGTH;
+		break;
+	case 17:
+		if (_httpscan_ieq8(name.ptr, "transfer-encoding", 17))
+			return HTTPSCAN_H_TRANSFER_ENCODING;
+		break;
+	}
+	return HTTPSCAN_H_UNKNOWN;
+}
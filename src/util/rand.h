@@ -0,0 +1,57 @@
+/** Fast pseudo-random number generator (xorshift64*)
+*/
+
+/*
+xrand_seed
+xrand_next
+xrand_range
+xrand_double
+xrand_exp
+*/
+
+#pragma once
+#include <ffbase/base.h>
+#include <math.h>
+
+struct xrand {
+	ffuint64 x;
+};
+
+/** Initialize the state
+Seeds are scrambled with splitmix64, so that close values (e.g. seed+thread#) produce unrelated sequences */
+static inline void xrand_seed(struct xrand *r, ffuint64 seed)
+{
+	ffuint64 z = seed + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	r->x = (z != 0) ? z : 1;
+}
+
+static inline ffuint64 xrand_next(struct xrand *r)
+{
+	ffuint64 x = r->x;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	r->x = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/** Get a value in range [0..n) */
+static inline ffuint xrand_range(struct xrand *r, ffuint n)
+{
+	return ((xrand_next(r) >> 32) * n) >> 32;
+}
+
+/** Get a value in range [0..1) */
+static inline double xrand_double(struct xrand *r)
+{
+	return (xrand_next(r) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/** Get an exponentially distributed value with the specified mean */
+static inline double xrand_exp(struct xrand *r, double mean)
+{
+	return -log(1 - xrand_double(r)) * mean;
+}
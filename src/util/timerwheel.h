@@ -0,0 +1,172 @@
+/** Hierarchical timer wheel
+*/
+
+/*
+twheel_init
+twheel_add twheel_del
+twheel_advance
+twheel_next
+*/
+
+/*
+4 levels of 64 slots each;  1 tick = 1 msec:
+	level 0: 0..64msec
+	level 1: ..4sec
+	level 2: ..4min
+	level 3: ..4.6hours
+A timer is placed on the lowest level where its expiration tick and the current tick
+ differ only in this level's bits (or lower).
+When the level-0 index wraps around, the timers from the next level's current slot
+ are moved to the lower levels.
+Add and delete are O(1).
+*/
+
+#pragma once
+#include <ffbase/base.h>
+
+#define TWHEEL_BITS  6
+#define TWHEEL_SLOTS  (1U << TWHEEL_BITS)
+#define TWHEEL_LEVELS  4
+
+struct twheel_timer;
+typedef void (*twheel_func)(struct twheel_timer *t);
+
+struct twheel_timer {
+	struct twheel_timer *next, *prev; // NULL if not armed
+	ffuint64 expire; // tick
+	twheel_func func;
+};
+
+struct twheel {
+	ffuint64 now; // current tick
+	ffuint n; // N of armed timers
+	struct twheel_timer slots[TWHEEL_LEVELS][TWHEEL_SLOTS]; // list sentinels
+};
+
+static inline void twheel_init(struct twheel *tw, ffuint64 now)
+{
+	tw->now = now;
+	tw->n = 0;
+	for (ffuint l = 0;  l != TWHEEL_LEVELS;  l++) {
+		for (ffuint i = 0;  i != TWHEEL_SLOTS;  i++) {
+			struct twheel_timer *s = &tw->slots[l][i];
+			s->next = s->prev = s;
+		}
+	}
+}
+
+static inline void _twheel_link(struct twheel *tw, struct twheel_timer *t)
+{
+	ffuint64 x = t->expire ^ tw->now;
+	ffuint l = 0;
+	while (l != TWHEEL_LEVELS - 1
+		&& (x >> (TWHEEL_BITS * (l + 1))) != 0) {
+		l++;
+	}
+
+	ffuint64 e = t->expire;
+	if ((x >> (TWHEEL_BITS * TWHEEL_LEVELS)) != 0) {
+		// too far: expire at the end of the current top-level rotation
+		e = tw->now | ((1ULL << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1);
+	}
+
+	struct twheel_timer *s = &tw->slots[l][(e >> (TWHEEL_BITS * l)) & (TWHEEL_SLOTS - 1)];
+	t->next = s;
+	t->prev = s->prev;
+	s->prev->next = t;
+	s->prev = t;
+}
+
+static inline void _twheel_unlink(struct twheel_timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+/** Arm (or re-arm) timer
+expire: tick */
+static inline void twheel_add(struct twheel *tw, struct twheel_timer *t, ffuint64 expire, twheel_func func)
+{
+	if (t->next != NULL)
+		_twheel_unlink(t);
+	else
+		tw->n++;
+
+	if (expire <= tw->now)
+		expire = tw->now + 1;
+	t->expire = expire;
+	t->func = func;
+	_twheel_link(tw, t);
+}
+
+/** Disarm timer (if armed) */
+static inline void twheel_del(struct twheel *tw, struct twheel_timer *t)
+{
+	if (t->next == NULL)
+		return;
+	_twheel_unlink(t);
+	tw->n--;
+}
+
+/** Move timers from a higher-level slot to the lower levels */
+static inline void _twheel_cascade(struct twheel *tw, ffuint l)
+{
+	struct twheel_timer *s = &tw->slots[l][(tw->now >> (TWHEEL_BITS * l)) & (TWHEEL_SLOTS - 1)];
+	struct twheel_timer *t = s->next;
+	s->next = s->prev = s;
+	while (t != s) {
+		struct twheel_timer *next = t->next;
+		_twheel_link(tw, t);
+		t = next;
+	}
+}
+
+/** Advance the current tick and call the handlers of the expired timers */
+static inline void twheel_advance(struct twheel *tw, ffuint64 now)
+{
+	if (tw->n == 0) {
+		if (now > tw->now)
+			tw->now = now;
+		return;
+	}
+
+	while (tw->now < now) {
+		tw->now++;
+
+		for (ffuint l = 1;  l != TWHEEL_LEVELS;  l++) {
+			if ((tw->now & ((1ULL << (TWHEEL_BITS * l)) - 1)) != 0)
+				break;
+			_twheel_cascade(tw, l);
+		}
+
+		struct twheel_timer *s = &tw->slots[0][tw->now & (TWHEEL_SLOTS - 1)];
+		while (s->next != s) {
+			struct twheel_timer *t = s->next;
+			_twheel_unlink(t);
+			tw->n--;
+			t->func(t); // may add new timers
+		}
+
+		if (tw->n == 0) {
+			tw->now = now;
+			break;
+		}
+	}
+}
+
+/** Get N of ticks until the next timer may expire
+Return -1 if there are no timers */
+static inline int twheel_next(struct twheel *tw)
+{
+	if (tw->n == 0)
+		return -1;
+
+	ffuint i = tw->now & (TWHEEL_SLOTS - 1);
+	for (ffuint n = 1;  n != TWHEEL_SLOTS - i;  n++) {
+		const struct twheel_timer *s = &tw->slots[0][i + n];
+		if (s->next != s)
+			return n;
+	}
+	return TWHEEL_SLOTS - i; // the next cascade
+}
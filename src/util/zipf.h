@@ -0,0 +1,88 @@
+/** Zipf-distributed random numbers: rejection-inversion sampling
+*/
+
+/*
+zipf_init
+zipf_next
+*/
+
+/*
+Rank k in [1..n] has probability proportional to 1/k^s.
+No table is built, so n may be very large;
+ a sample takes 1 random value in most cases (Hörmann, Derflinger: "Rejection-inversion to generate variates from monotone discrete distributions").
+*/
+
+#pragma once
+#include <util/rand.h>
+#include <math.h>
+
+struct zipf {
+	ffuint64 n;
+	double s;
+	double h_x1, h_n, s_param;
+};
+
+/** log(1+x)/x */
+static inline double _zipf_helper1(double x)
+{
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1.0/3 - 0.25 * x));
+}
+
+/** (exp(x)-1)/x */
+static inline double _zipf_helper2(double x)
+{
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+/** Integral of h(x)=1/x^s */
+static inline double _zipf_hint(const struct zipf *z, double x)
+{
+	double lx = log(x);
+	return _zipf_helper2((1 - z->s) * lx) * lx;
+}
+
+static inline double _zipf_h(const struct zipf *z, double x)
+{
+	return exp(-z->s * log(x));
+}
+
+static inline double _zipf_hint_inv(const struct zipf *z, double x)
+{
+	double t = x * (1 - z->s);
+	if (t < -1)
+		t = -1; // precision loss near the lower bound
+	return exp(_zipf_helper1(t) * x);
+}
+
+/**
+n: N of ranks
+s: exponent, >0 */
+static inline void zipf_init(struct zipf *z, ffuint64 n, double s)
+{
+	z->n = n;
+	z->s = s;
+	z->h_x1 = _zipf_hint(z, 1.5) - 1;
+	z->h_n = _zipf_hint(z, n + 0.5);
+	z->s_param = 2 - _zipf_hint_inv(z, _zipf_hint(z, 2.5) - _zipf_h(z, 2));
+}
+
+/** Get rank in range [0..n): 0 is the most frequent */
+static inline ffuint64 zipf_next(const struct zipf *z, struct xrand *r)
+{
+	for (;;) {
+		double u = z->h_n + xrand_double(r) * (z->h_x1 - z->h_n);
+		double x = _zipf_hint_inv(z, u);
+		double k = floor(x + 0.5);
+		if (k < 1)
+			k = 1;
+		else if (k > z->n)
+			k = z->n;
+		if (k - x <= z->s_param
+			|| u >= _zipf_hint(z, k + 0.5) - _zipf_h(z, k))
+			return (ffuint64)k - 1;
+	}
+}
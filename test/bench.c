@@ -0,0 +1,216 @@
+/** aggressor: throughput of HTTP/1 parsers and writers
+*/
+
+/*
+Usage: make bench [SSE42=0]
+Each function is called in a loop until a round takes at least 50msec,
+ then the fastest of 5 rounds is reported, so the output is stable enough to diff between commits:
+	NAME  NS/OP ns/op  GB/S GB/s
+GB/s is computed from the size of the input processed by one call.
+*/
+
+#include <util/http1.h>
+#include <FFOS/time.h>
+#include <FFOS/std.h>
+
+int _ffcpu_features;
+int httpscan_cpu;
+
+static volatile ffsize sink; // results are accumulated here so the calls are not optimized out
+
+static ffuint64 time_nsec()
+{
+	fftime t = fftime_monotonic();
+	return t.sec*1000000000ULL + t.nsec;
+}
+
+typedef void (*bench_func)(const ffstr *data);
+
+#define ROUND_NSEC  50000000
+#define ROUNDS  5
+
+static void bench_run(const char *name, bench_func f, const ffstr *data)
+{
+	ffuint64 iters = 1, t, best = (ffuint64)-1;
+	for (;;) {
+		t = time_nsec();
+		for (ffuint64 i = 0;  i != iters;  i++) {
+			f(data);
+		}
+		t = time_nsec() - t;
+		if (t >= ROUND_NSEC)
+			break;
+		iters *= 2;
+	}
+
+	for (uint r = 0;  r != ROUNDS;  r++) {
+		t = time_nsec();
+		for (ffuint64 i = 0;  i != iters;  i++) {
+			f(data);
+		}
+		t = time_nsec() - t;
+		if (t < best)
+			best = t;
+	}
+
+	double ns = (double)best / iters;
+	static const char spaces[] = "                                    ";
+	ffsize n = ffsz_len(name);
+	ffstdout_fmt("%s%*s %.1F ns/op  %.3F GB/s\n"
+		, name, (ffsize)((n < 36) ? 36 - n : 0), spaces, ns, data->len / ns);
+}
+
+
+static const char resp_nginx404[] =
+"HTTP/1.1 404 Not Found\r\n"
+"Server: nginx/1.24.0\r\n"
+"Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n"
+"Content-Type: text/html\r\n"
+"Content-Length: 153\r\n"
+"Connection: keep-alive\r\n"
+"\r\n";
+
+static const char resp_cdn[] =
+"HTTP/1.1 200 OK\r\n"
+"Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n"
+"Content-Type: application/javascript; charset=utf-8\r\n"
+"Content-Length: 48213\r\n"
+"Connection: keep-alive\r\n"
+"Cache-Control: public, max-age=31536000, immutable\r\n"
+"ETag: \"5f3c7a1e-bc55\"\r\n"
+"Last-Modified: Tue, 11 Aug 2026 07:21:34 GMT\r\n"
+"Expires: Sun, 17 Oct 2027 10:00:00 GMT\r\n"
+"Age: 86123\r\n"
+"Accept-Ranges: bytes\r\n"
+"Vary: Accept-Encoding, Origin\r\n"
+"Access-Control-Allow-Origin: *\r\n"
+"Access-Control-Allow-Methods: GET, HEAD, OPTIONS\r\n"
+"Access-Control-Expose-Headers: Content-Length, Content-Range, ETag\r\n"
+"Timing-Allow-Origin: *\r\n"
+"Strict-Transport-Security: max-age=63072000; includeSubDomains; preload\r\n"
+"Content-Security-Policy: default-src 'self'; script-src 'self' https://cdn.example.com; object-src 'none'; base-uri 'self'\r\n"
+"X-Content-Type-Options: nosniff\r\n"
+"X-Frame-Options: SAMEORIGIN\r\n"
+"X-XSS-Protection: 1; mode=block\r\n"
+"Referrer-Policy: strict-origin-when-cross-origin\r\n"
+"Permissions-Policy: geolocation=(), microphone=(), camera=()\r\n"
+"Server: cdn-edge\r\n"
+"Via: 1.1 varnish, 1.1 edge-fra2\r\n"
+"X-Cache: HIT, HIT\r\n"
+"X-Cache-Hits: 41, 1022\r\n"
+"X-Served-By: cache-fra19132-FRA, cache-ams21054-AMS\r\n"
+"X-Timer: S1792238400.123456,VS0,VE0\r\n"
+"X-Request-Id: 4b1f0c36-8d2e-4c0e-9a51-3f7e8b2d9c10\r\n"
+"Alt-Svc: h3=\":443\"; ma=86400\r\n"
+"Server-Timing: cdn-cache; desc=HIT, edge; dur=1, origin; dur=0\r\n"
+"NEL: {\"report_to\":\"default\",\"max_age\":31536000,\"include_subdomains\":true}\r\n"
+"Report-To: {\"group\":\"default\",\"max_age\":31536000,\"endpoints\":[{\"url\":\"https://r.example.com/nel\"}]}\r\n"
+"\r\n";
+
+static const char url_simple[] = "127.0.0.1:8080/index.html";
+static const char url_full[] = "http://[::1]:8080/api/v1/items/12345?fields=id,name,price&sort=desc#top";
+
+static ffvec chunked_large, chunked_small;
+
+/** Prepare chunked body: 'n' chunks of pseudo-random size within [min..min+range) */
+static void chunked_prepare(ffvec *v, uint n, uint min, uint range)
+{
+	char hdr[18];
+	ffstr h, trl;
+	uint seed = 1;
+	for (uint i = 0;  i != n;  i++) {
+		seed = seed * 1103515245 + 12345;
+		uint size = min + (seed >> 8) % range;
+		httpchunked_write(hdr, size, &h, &trl);
+		ffvec_addstr(v, &h);
+		ffvec_grow(v, size, 1);
+		ffmem_fill((char*)v->ptr + v->len, 'x', size);
+		v->len += size;
+		ffvec_addstr(v, &trl);
+	}
+	ffvec_addsz(v, "0\r\n\r\n");
+}
+
+
+static void b_resp_parse(const ffstr *data)
+{
+	ffstr proto, msg;
+	uint code;
+	sink += http_resp_parse(*data, &proto, &code, &msg) + code;
+}
+
+/** Status line and all header fields, as the client does it */
+static void b_resp_hdrs(const ffstr *data)
+{
+	ffstr d = *data, proto, msg, name, val;
+	uint code;
+	int r = http_resp_parse(d, &proto, &code, &msg);
+	ffstr_shift(&d, r);
+	for (;;) {
+		r = http_hdr_parse(d, &name, &val);
+		if (r <= 2)
+			break;
+		ffstr_shift(&d, r);
+		sink += httpscan_hdr_id(name);
+	}
+	sink += d.len;
+}
+
+static void b_chunked(const ffstr *data)
+{
+	struct httpchunked c = {};
+	ffstr d = *data, out;
+	for (;;) {
+		ffssize r = httpchunked_parse(&c, d, &out);
+		if (r <= 0)
+			break;
+		ffstr_shift(&d, r);
+		sink += out.len;
+	}
+}
+
+static void b_req_write(const ffstr *data)
+{
+	char buf[256];
+	ffstr method = FFSTR_Z("GET");
+	sink += http_req_write(buf, sizeof(buf), method, *data, 0);
+}
+
+static void b_url_split(const ffstr *data)
+{
+	struct httpurl_parts u = {};
+	httpurl_split(&u, *data);
+	sink += u.path.len;
+}
+
+int main(int argc, char **argv)
+{
+	httpscan_init();
+	ffstdout_fmt("CPU features: %s%s\n"
+		, (httpscan_cpu & HTTPSCAN_SSE42) ? "sse4.2 " : ""
+		, (httpscan_cpu & HTTPSCAN_AVX2) ? "avx2" : "");
+
+	chunked_prepare(&chunked_large, 64, 512, 4096);
+	chunked_prepare(&chunked_small, 256, 16, 256);
+
+	ffstr nginx404 = FFSTR_INITN(resp_nginx404, sizeof(resp_nginx404) - 1);
+	ffstr cdn = FFSTR_INITN(resp_cdn, sizeof(resp_cdn) - 1);
+	ffstr chl = FFSTR_INITN(chunked_large.ptr, chunked_large.len);
+	ffstr chs = FFSTR_INITN(chunked_small.ptr, chunked_small.len);
+	ffstr path = FFSTR_Z("/api/v1/items/12345?fields=id,name,price");
+	ffstr us = FFSTR_INITN(url_simple, sizeof(url_simple) - 1);
+	ffstr uf = FFSTR_INITN(url_full, sizeof(url_full) - 1);
+
+	bench_run("http_resp_parse/nginx404", b_resp_parse, &nginx404);
+	bench_run("http_hdr_parse/nginx404", b_resp_hdrs, &nginx404);
+	bench_run("http_hdr_parse/cdn-33-fields", b_resp_hdrs, &cdn);
+	bench_run("httpchunked_parse/64x512-4607", b_chunked, &chl);
+	bench_run("httpchunked_parse/256x16-271", b_chunked, &chs);
+	bench_run("http_req_write/path", b_req_write, &path);
+	bench_run("httpurl_split/simple", b_url_split, &us);
+	bench_run("httpurl_split/full", b_url_split, &uf);
+
+	ffvec_free(&chunked_large);
+	ffvec_free(&chunked_small);
+	return 0;
+}